@@ -23,6 +23,7 @@
 #include <QtWidgets>
 #include "nodewidget.h"
 #include "miaguiconstants.h"
+#include "src/labelingnetworkset.h"
 
 namespace mia {
 
@@ -175,6 +176,8 @@ ConfigurationPageMisc::ConfigurationPageMisc(QWidget *parent)
 {
     initNodeLayoutGroupBox();
     initM0OptionsGroupBox();
+    initIonPairGroupBox();
+    initEdgeModeGroupBox();
 
     QVBoxLayout *vl = new QVBoxLayout(this);
 
@@ -186,10 +189,26 @@ ConfigurationPageMisc::ConfigurationPageMisc(QWidget *parent)
     useLargestCommonIon->setChecked(s.value("nw_use_common_largest_ion", NW_USE_LARGEST_COMMON_ION).toBool());
     vl->addWidget(useLargestCommonIon);
 
+    percentileCutoff = new QCheckBox("Distance cutoff as percentage of closest compound pairs", this);
+    percentileCutoff->setChecked(s.value("network_cutoff_percentile", false).toBool());
+    vl->addWidget(percentileCutoff);
+
     vl->addWidget(nodeLayoutGroupBox);
 
     vl->addWidget(m0OptionsGroupBox);
 
+    vl->addWidget(ionPairGroupBox);
+
+    vl->addWidget(edgeModeGroupBox);
+
+    QHBoxLayout *threadsLayout = new QHBoxLayout();
+    threadsLayout->addWidget(new QLabel("Threads for distance calculation (0: one per core)", this));
+    distanceThreads = new QSpinBox(this);
+    distanceThreads->setRange(0, 256);
+    distanceThreads->setValue(s.value("alignment_threads", 0).toInt());
+    threadsLayout->addWidget(distanceThreads);
+    vl->addLayout(threadsLayout);
+
     setLayout(vl);
 }
 
@@ -199,9 +218,19 @@ void ConfigurationPageMisc::save()
 
     s.setValue("alignment_m0", m0OptionsGroup->checkedId());
 
+    s.setValue("alignment_ion_pairs", ionPairGroup->checkedId());
+
+    s.setValue("alignment_threads", distanceThreads->value());
+
+    s.setValue("network_edge_mode", edgeModeGroup->checkedId());
+    s.setValue("network_knn", nearestNeighborCount->value());
+    s.setValue("network_max_edges_per_node", maxEdgesPerNode->value());
+
     s.setValue("graph_show_unconnected_nodes", showUnconnectedNodes->isChecked());
 
     s.setValue("nw_use_common_largest_ion", useLargestCommonIon->isChecked());
+
+    s.setValue("network_cutoff_percentile", percentileCutoff->isChecked());
 }
 
 void ConfigurationPageMisc::initNodeLayoutGroupBox()
@@ -281,5 +310,83 @@ void ConfigurationPageMisc::initM0OptionsGroupBox()
     m0OptionsGroupBox->setLayout(vl);
 }
 
+void ConfigurationPageMisc::initIonPairGroupBox()
+{
+    int mode = s.value("alignment_ion_pairs", LabelingNetworkSet::IP_SELECTED_ION).toInt();
+
+    ionPairGroup = new QButtonGroup(this);
+
+    ionPairSelected = new QRadioButton("Selected ion only", this);
+    ionPairMin = new QRadioButton("Best matching pair of labeled ions", this);
+    ionPairWeightedMean = new QRadioButton("All pairs of labeled ions, weighted by R2", this);
+
+    switch (mode) {
+    case LabelingNetworkSet::IP_MIN:
+        ionPairMin->setChecked(true);
+        break;
+    case LabelingNetworkSet::IP_WEIGHTED_MEAN:
+        ionPairWeightedMean->setChecked(true);
+        break;
+    default:
+        ionPairSelected->setChecked(true);
+    }
+
+    ionPairGroup->addButton(ionPairSelected, LabelingNetworkSet::IP_SELECTED_ION);
+    ionPairGroup->addButton(ionPairMin, LabelingNetworkSet::IP_MIN);
+    ionPairGroup->addButton(ionPairWeightedMean, LabelingNetworkSet::IP_WEIGHTED_MEAN);
+
+    ionPairGroupBox = new QGroupBox("Distance calculation ions", this);
+    QVBoxLayout *vl = new QVBoxLayout(ionPairGroupBox);
+    vl->addWidget(ionPairSelected);
+    vl->addWidget(ionPairMin);
+    vl->addWidget(ionPairWeightedMean);
+
+    ionPairGroupBox->setLayout(vl);
+}
+
+void ConfigurationPageMisc::initEdgeModeGroupBox()
+{
+    int mode = s.value("network_edge_mode", LabelingNetworkSet::EM_THRESHOLD).toInt();
+
+    edgeModeGroup = new QButtonGroup(this);
+
+    edgeModeThreshold = new QRadioButton("Distance cutoff", this);
+    edgeModeNearestNeighbors = new QRadioButton("k nearest neighbors (for many compounds)", this);
+
+    switch (mode) {
+    case LabelingNetworkSet::EM_NEAREST_NEIGHBORS:
+        edgeModeNearestNeighbors->setChecked(true);
+        break;
+    default:
+        edgeModeThreshold->setChecked(true);
+    }
+
+    edgeModeGroup->addButton(edgeModeThreshold, LabelingNetworkSet::EM_THRESHOLD);
+    edgeModeGroup->addButton(edgeModeNearestNeighbors, LabelingNetworkSet::EM_NEAREST_NEIGHBORS);
+
+    QHBoxLayout *maxEdgesLayout = new QHBoxLayout();
+    maxEdgesLayout->addWidget(new QLabel("Maximum edges per node (0: unlimited)", this));
+    maxEdgesPerNode = new QSpinBox(this);
+    maxEdgesPerNode->setRange(0, 1000);
+    maxEdgesPerNode->setValue(s.value("network_max_edges_per_node", 0).toInt());
+    maxEdgesLayout->addWidget(maxEdgesPerNode);
+
+    QHBoxLayout *knnLayout = new QHBoxLayout();
+    knnLayout->addWidget(new QLabel("k", this));
+    nearestNeighborCount = new QSpinBox(this);
+    nearestNeighborCount->setRange(1, 100);
+    nearestNeighborCount->setValue(s.value("network_knn", 5).toInt());
+    knnLayout->addWidget(nearestNeighborCount);
+
+    edgeModeGroupBox = new QGroupBox("Network edges", this);
+    QVBoxLayout *vl = new QVBoxLayout(edgeModeGroupBox);
+    vl->addWidget(edgeModeThreshold);
+    vl->addLayout(maxEdgesLayout);
+    vl->addWidget(edgeModeNearestNeighbors);
+    vl->addLayout(knnLayout);
+
+    edgeModeGroupBox->setLayout(vl);
+}
+
 
 }
@@ -102,11 +102,28 @@ private:
     QRadioButton *m0OmitScaleSum;
     QGroupBox *m0OptionsGroupBox;
 
+    QButtonGroup *ionPairGroup;
+    QRadioButton *ionPairSelected;
+    QRadioButton *ionPairMin;
+    QRadioButton *ionPairWeightedMean;
+    QGroupBox *ionPairGroupBox;
+
+    QButtonGroup *edgeModeGroup;
+    QRadioButton *edgeModeThreshold;
+    QSpinBox *maxEdgesPerNode;
+    QRadioButton *edgeModeNearestNeighbors;
+    QSpinBox *nearestNeighborCount;
+    QGroupBox *edgeModeGroupBox;
+
     QCheckBox *showUnconnectedNodes;
     QCheckBox *useLargestCommonIon;
+    QCheckBox *percentileCutoff;
+    QSpinBox *distanceThreads;
 
     void initNodeLayoutGroupBox();
     void initM0OptionsGroupBox();
+    void initIonPairGroupBox();
+    void initEdgeModeGroupBox();
 
     QSettings s;
 
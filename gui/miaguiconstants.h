@@ -25,6 +25,7 @@
 
 namespace mia {
     const double DISTANCE_CUTOFF_SLIDER_IMPLICIT_MAXIMUM = 0.2;
+    const double DISTANCE_CUTOFF_SLIDER_PERCENTILE_MAXIMUM = 5; // percent of node pairs at the slider maximum in percentile mode
 }
 
 #endif // MIAGUICONSTANTS_H
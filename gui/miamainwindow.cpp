@@ -64,7 +64,6 @@ MIAMainWindow::~MIAMainWindow()
 {
     delete view;
     delete scene;
-    delete LabelingNetworkSet::distCalc;
     delete g;
 
 #ifdef MIA_WITH_NETCDF_IMPORT
@@ -98,6 +97,12 @@ void MIAMainWindow::recreateGraph()
     emit(progressText("Creating graph."));
 
     networkSet->setExcludeM0(qsettings.value("alignment_m0", 0).toInt());
+    networkSet->setIonPairMode((LabelingNetworkSet::ION_PAIR_MODE) qsettings.value("alignment_ion_pairs", LabelingNetworkSet::IP_SELECTED_ION).toInt());
+    networkSet->setThreadCount(qsettings.value("alignment_threads", 0).toInt());
+    networkSet->setNearestNeighborCount(qsettings.value("network_knn", 5).toInt());
+    networkSet->setEdgeMode((LabelingNetworkSet::EDGE_MODE) qsettings.value("network_edge_mode", LabelingNetworkSet::EM_THRESHOLD).toInt());
+    networkSet->setMaxEdgesPerNode(qsettings.value("network_max_edges_per_node", 0).toInt());
+    networkSet->updateDistanceMatrices(); // single recalculation for all changed settings
     updateCompoundList();
     setupExperimentOverlayGraph();
 }
@@ -131,7 +136,6 @@ void MIAMainWindow::labelDetectionFinished()
     matchCompoundsAgainstLibrary();
     experimentListWidget->updateExperimentList(networkSet->getDatasets(), experimentColors);
     updateCompoundList();
-    networkSet->createDistanceMatrices();
     recreateGraph();
 
     if(progressDialog) {
@@ -185,11 +189,11 @@ void MIAMainWindow::init()
 
     g = new graphvizqt::Graph();
 
-    LabelingNetworkSet::distCalc = new MIDDistanceCalculator(NW_GAP_PENALTY);
     graphSizeWarningLimit = 200;
     excludeLib = 0;
     progressDialog = 0;
     networkSet = new LabelingNetworkSet();
+    connect(networkSet, SIGNAL(layerDistancesReady(int)), this, SLOT(layerDistancesReady(int)));
 #ifdef MIA_WITH_NETCDF_IMPORT
     netCDFImportDialog = 0;
 #endif
@@ -509,7 +513,7 @@ void MIAMainWindow::setupGraphOptionPanel()
         vl->addWidget(metricLabel);
         QListWidget *distanceList = new QListWidget(nwWidget);
         QStringList listItems;
-        listItems<<"Canberra"<<"Euclidean"<<"Manhattan"<<"Cosine"<<"Custom";
+        listItems<<"Canberra"<<"Euclidean"<<"Manhattan"<<"Cosine"<<"Custom"<<"CI-weighted"<<"EMD (no alignment)";
         distanceList->addItems(listItems);
         distanceList->setCurrentRow(0);
         distanceList->sortItems();    
@@ -739,11 +743,19 @@ void MIAMainWindow::cutOffSliderChanged(int i)
 #endif
         double percent = 100.0 * (i - cutOffSlider->minimum())
                 / (cutOffSlider->maximum() - cutOffSlider->minimum());
-        // set slider maximum to 70%, because only lower range of interest
-        percent *= DISTANCE_CUTOFF_SLIDER_IMPLICIT_MAXIMUM;
-        networkSet->setRelativeDistanceCutoff(percent);
+        if(qsettings.value("network_cutoff_percentile", false).toBool()) {
+            // closest pairs, independent of outlying distances
+            percent *= DISTANCE_CUTOFF_SLIDER_PERCENTILE_MAXIMUM / 100.0;
+            networkSet->setPercentileDistanceCutoff(percent);
 
-        cutOffLabel->setText(QString::number(percent) + " %");
+            cutOffLabel->setText(QString::number(percent) + " % of pairs");
+        } else {
+            // set slider maximum to 70%, because only lower range of interest
+            percent *= DISTANCE_CUTOFF_SLIDER_IMPLICIT_MAXIMUM;
+            networkSet->setRelativeDistanceCutoff(percent);
+
+            cutOffLabel->setText(QString::number(percent) + " %");
+        }
 
 #ifdef MIAMAINWINDOW_H_ENABLE_ZSCORE
     }
@@ -762,18 +774,19 @@ void MIAMainWindow::variationSliderChanged(int i)
 void MIAMainWindow::distanceMeasureChanged(QString cur)
 {
     if(cur == "Euclidean")
-        LabelingNetworkSet::distCalc->distanceMeasure = MIDDistanceCalculator::D_EUCLIDEAN;
+        networkSet->setDistanceMeasure(MIDDistanceCalculator::D_EUCLIDEAN);
     else if(cur == "Canberra")
-        LabelingNetworkSet::distCalc->distanceMeasure = MIDDistanceCalculator::D_CANBERRA;
+        networkSet->setDistanceMeasure(MIDDistanceCalculator::D_CANBERRA);
     else if(cur == "Cosine")
-        LabelingNetworkSet::distCalc->distanceMeasure = MIDDistanceCalculator::D_COSINE;
+        networkSet->setDistanceMeasure(MIDDistanceCalculator::D_COSINE);
     else if(cur == "Manhattan")
-        LabelingNetworkSet::distCalc->distanceMeasure = MIDDistanceCalculator::D_MANHATTAN;
+        networkSet->setDistanceMeasure(MIDDistanceCalculator::D_MANHATTAN);
     else if(cur == "Custom")
-        LabelingNetworkSet::distCalc->distanceMeasure = MIDDistanceCalculator::D_CUSTOM;
-
-    // recalculate all distances
-    networkSet->createDistanceMatrices();
+        networkSet->setDistanceMeasure(MIDDistanceCalculator::D_CUSTOM);
+    else if(cur == "CI-weighted")
+        networkSet->setDistanceMeasure(MIDDistanceCalculator::D_CI_WEIGHTED);
+    else if(cur == "EMD (no alignment)")
+        networkSet->setDistanceMeasure(MIDDistanceCalculator::D_EMD);
 
     // reset distance slider and cutoff
     cutOffSlider->setSliderPosition(0);
@@ -785,18 +798,15 @@ void MIAMainWindow::distanceMeasureChanged(QString cur)
 void MIAMainWindow::distanceMeasureNormChanged(QString cur)
 {
     if(cur == "MAX")
-        LabelingNetworkSet::distCalc->distanceNormalization = MIDDistanceCalculator::DN_MAX;
+        networkSet->setDistanceNormalization(MIDDistanceCalculator::DN_MAX);
     else if(cur == "MIN")
-        LabelingNetworkSet::distCalc->distanceNormalization = MIDDistanceCalculator::DN_MIN;
+        networkSet->setDistanceNormalization(MIDDistanceCalculator::DN_MIN);
     else if(cur == "PROD")
-        LabelingNetworkSet::distCalc->distanceNormalization = MIDDistanceCalculator::DN_PROD;
+        networkSet->setDistanceNormalization(MIDDistanceCalculator::DN_PROD);
     else if(cur == "SUM")
-        LabelingNetworkSet::distCalc->distanceNormalization = MIDDistanceCalculator::DN_SUM;
+        networkSet->setDistanceNormalization(MIDDistanceCalculator::DN_SUM);
     else if(cur == "NONE")
-        LabelingNetworkSet::distCalc->distanceNormalization = MIDDistanceCalculator::DN_ONE;
-
-    // recalculate all distances
-    networkSet->createDistanceMatrices();
+        networkSet->setDistanceNormalization(MIDDistanceCalculator::DN_ONE);
 
     // reset slider pos and cutoff
     cutOffSlider->setSliderPosition(0);
@@ -876,7 +886,12 @@ void MIAMainWindow::showConfigDialog()
     //matchCompoundsAgainstLibrary();
 
     networkSet->setExcludeM0(qsettings.value("alignment_m0", 0).toInt());
-    networkSet->createDistanceMatrices();
+    networkSet->setIonPairMode((LabelingNetworkSet::ION_PAIR_MODE) qsettings.value("alignment_ion_pairs", LabelingNetworkSet::IP_SELECTED_ION).toInt());
+    networkSet->setThreadCount(qsettings.value("alignment_threads", 0).toInt());
+    networkSet->setNearestNeighborCount(qsettings.value("network_knn", 5).toInt());
+    networkSet->setEdgeMode((LabelingNetworkSet::EDGE_MODE) qsettings.value("network_edge_mode", LabelingNetworkSet::EM_THRESHOLD).toInt());
+    networkSet->setMaxEdgesPerNode(qsettings.value("network_max_edges_per_node", 0).toInt());
+    networkSet->updateDistanceMatrices();
     setupExperimentOverlayGraph();
     experimentListWidget->updateExperimentList(networkSet->getDatasets(), experimentColors);
     updateCompoundList();
@@ -939,9 +954,26 @@ void MIAMainWindow::experimentSelectionChanged()
 
 void MIAMainWindow::experimentRemoved(NetworkLayer *ds)
 {
+    // nodes without data left are deleted
+    qDeleteAll(nodeWidgets);
+    nodeWidgets.clear();
+
     networkSet->removeDataset(ds);
     delete ds;
-    labelDetectionFinished();
+
+    experimentListWidget->updateExperimentList(networkSet->getDatasets(), experimentColors);
+    updateCompoundList();
+    recreateGraph();
+}
+
+/**
+ * @brief Report progress while the remaining distance matrices are calculated. The event loop must not be entered here:
+ * other layers are still being calculated, partly in place in the network set's matrices.
+ */
+void MIAMainWindow::layerDistancesReady(int datasetIndex)
+{
+    NetworkLayer *ds = networkSet->getDataset(datasetIndex);
+    emit(progressText(QString("Distances ready for <%1>.").arg(QString::fromStdString(ds->getSettings().experiment))));
 }
 
 void MIAMainWindow::closeEvent(QCloseEvent *event)
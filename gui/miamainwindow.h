@@ -99,6 +99,7 @@ public slots:
     void addExperiment(Settings s);
     void experimentSelectionChanged();
     void experimentRemoved(NetworkLayer *ds);
+    void layerDistancesReady(int datasetIndex);
     void closeEvent(QCloseEvent *event);
 #ifdef MIA_WITH_NETCDF_IMPORT
     void showDataImportDialog();
@@ -0,0 +1,147 @@
+//
+// MIA - Mass Isotopolome Analyzer
+// Copyright (C) 2013-15 Daniel Weindl <daniel@danielweindl.de>
+//
+// This file is part of MIA.
+//
+// MIA is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// MIA is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with MIA.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "distancesketch.h"
+
+namespace mia {
+
+const double DistanceSketch::relativeAccuracy = 0.01;
+const double DistanceSketch::minDistance = 1e-9;
+
+// bin i holds distances in (binBase^(i-1), binBase^i]
+static const double binBase = 1 + DistanceSketch::relativeAccuracy;
+static const double logBinBase = std::log(binBase);
+
+DistanceSketch::DistanceSketch()
+    : count(0), zeroCount(0), offset(0)
+{
+}
+
+/**
+ * @brief Add a distance. NaN and infinite distances are ignored.
+ */
+void DistanceSketch::add(double distance)
+{
+    if(std::isnan(distance) || std::isinf(distance))
+        return;
+
+    ++count;
+    if(distance < minDistance) {
+        ++zeroCount;
+        return;
+    }
+
+    int bin = getBin(distance);
+    if(counts.empty()) {
+        offset = bin;
+        counts.push_back(0);
+    } else if(bin < offset) {
+        counts.insert(counts.begin(), offset - bin, 0);
+        offset = bin;
+    } else if(bin >= offset + (int)counts.size()) {
+        counts.resize(bin - offset + 1, 0);
+    }
+    ++counts[bin - offset];
+}
+
+/**
+ * @brief Remove a distance that was added before. NaN and infinite distances are ignored.
+ */
+void DistanceSketch::remove(double distance)
+{
+    if(std::isnan(distance) || std::isinf(distance))
+        return;
+
+    --count;
+    if(distance < minDistance)
+        --zeroCount;
+    else
+        --counts[getBin(distance) - offset];
+}
+
+/**
+ * @brief Add all distances of @p other.
+ */
+void DistanceSketch::merge(const DistanceSketch &other)
+{
+    if(other.counts.size()) {
+        if(counts.empty()) {
+            offset = other.offset;
+            counts.assign(other.counts.size(), 0);
+        }
+        int begin = std::min(offset, other.offset);
+        int end = std::max(offset + (int)counts.size(), other.offset + (int)other.counts.size());
+        if(begin < offset)
+            counts.insert(counts.begin(), offset - begin, 0);
+        offset = begin;
+        counts.resize(end - begin, 0);
+        for(int i = 0; i < other.counts.size(); ++i)
+            counts[other.offset - offset + i] += other.counts[i];
+    }
+    count += other.count;
+    zeroCount += other.zeroCount;
+}
+
+void DistanceSketch::clear()
+{
+    count = 0;
+    zeroCount = 0;
+    offset = 0;
+    counts.clear();
+}
+
+size_t DistanceSketch::getCount() const
+{
+    return count;
+}
+
+/**
+ * @brief Upper bound of the @p rank-th smallest distance (0-based), at most relativeAccuracy above it.
+ * Infinite if @p rank is not less than getCount().
+ */
+double DistanceSketch::getValueAtRank(size_t rank) const
+{
+    if(rank >= count)
+        return std::numeric_limits<double>::infinity();
+    if(rank < zeroCount)
+        return minDistance;
+
+    size_t seen = zeroCount;
+    for(int i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if(rank < seen)
+            return std::pow(binBase, offset + i);
+    }
+    return std::numeric_limits<double>::infinity();
+}
+
+int DistanceSketch::getBin(double distance) const
+{
+    int bin = (int)std::ceil(std::log(distance) / logBinBase);
+    // rounding near bin edges, the bin's upper edge must not be below the distance
+    if(std::pow(binBase, bin) < distance)
+        ++bin;
+    return bin;
+}
+
+}
@@ -0,0 +1,64 @@
+/* * MIA - Mass Isotopolome Analyzer
+ * Copyright (C) 2013-15 Daniel Weindl <daniel@danielweindl.de>
+ *
+ * This file is part of MIA.
+ *
+ * MIA is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * MIA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with MIA.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DISTANCESKETCH_H
+#define DISTANCESKETCH_H
+
+#include <vector>
+#include <cstddef>
+
+namespace mia {
+
+/**
+ * @brief The DistanceSketch class is a streaming histogram of non-negative distances for quantile queries.
+ *
+ * Bins are logarithmic, so each bin spans a fixed relative distance range and quantiles are accurate to
+ * relativeAccuracy whatever the range of distances. Memory and query time depend on the number of bins, not on
+ * the number of distances. Sketches can be merged, and distances can be removed again, because bins are
+ * fixed by the distance alone.
+ */
+class DistanceSketch
+{
+public:
+    DistanceSketch();
+
+    void add(double distance);
+    void remove(double distance);
+    void merge(const DistanceSketch &other);
+    void clear();
+
+    size_t getCount() const;
+    double getValueAtRank(size_t rank) const;
+
+    static const double relativeAccuracy; /**< Maximum relative error of getValueAtRank() */
+    static const double minDistance; /**< Smaller distances are counted as 0 */
+
+private:
+    int getBin(double distance) const;
+
+    size_t count; /**< Number of distances */
+    size_t zeroCount; /**< Number of distances below minDistance */
+    int offset; /**< Bin of counts[0] */
+    std::vector<size_t> counts; /**< Number of distances by bin */
+};
+
+}
+
+#endif // DISTANCESKETCH_H
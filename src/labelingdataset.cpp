@@ -38,6 +38,7 @@
 
 #include "nodecompound.h"
 #include "labelingdataset.h"
+#include "middistancecalculator.h"
 #include "utilities.h"
 
 
@@ -45,6 +46,71 @@
 namespace mia
 {
 
+namespace {
+
+// Distance settings for doScoring(): dot product of the aligned MIDs divided by the squared aligned length, with
+// end gaps penalized and consecutive gaps discounted as always done for single datasets
+MIDDistanceCalculator::Config getScoringConfig(const Settings &settings)
+{
+    return MIDDistanceCalculator::Config(settings.nw_gap_penalty, MIDDistanceCalculator::D_COSINE, MIDDistanceCalculator::DN_PROD)
+            .withGapModel(MIDDistanceCalculator::GM_CONSECUTIVE_GAP_DISCOUNT);
+}
+
+// Writes score matrix and aligned MIDs of each traced alignment as HTML tables, see distsOverviewHTML()
+class HTMLAlignmentTrace : public AlignmentTraceSink
+{
+public:
+    HTMLAlignmentTrace(std::ofstream &ofs) : ofs(ofs) {}
+
+    void trace(const MIDView &mid1, const MIDView &mid2, const NWWorkspace &ws, int alignedSize, double) {
+        const int cols = mid2.size + 1;
+
+        // v2 header
+        ofs<<"<table border=1><tr><td></td><td><b>0</b></td>"<<std::endl;
+        for(int j = 0; j < mid2.size; ++j)
+            ofs<<"<td><b>"<<mid2[j]<<"</b></td>";
+        ofs<<"</tr>"<<std::endl;
+
+        for(int i = 0; i <= mid1.size; ++i) { // row
+            ofs<<"<tr><td><b>"<<(i==0?0:mid1[i - 1])<<"</b></td>";
+            for(int j = 0; j < cols; ++j) // col
+                ofs<<"<td>"<<ws.scoreMat[i * cols + j]<<"</td>";
+            ofs << "</tr>\n";
+        }
+        ofs<<"</table>\n";
+
+        // steps of the alignment to tell gaps from zero abundances
+        std::vector<char> steps(alignedSize);
+        int i = mid1.size;
+        int j = mid2.size;
+        for(int pos = alignedSize - 1; pos >= 0; --pos) {
+            steps[pos] = ws.tracebackMat[i * cols + j];
+            if(steps[pos] != '-')
+                --i;
+            if(steps[pos] != '|')
+                --j;
+        }
+
+        // aligned MIDs, gaps as -999
+        const double *alV1 = ws.getAligned1();
+        const double *alV2 = ws.getAligned2();
+        ofs <<"<br><table border=1><tr>";
+        ofs << std::setw(6) << std::setprecision(4) << std::resetiosflags(std::ios::right);
+        for(int pos = 0; pos < alignedSize; ++pos)
+            ofs << "<td>"<<(steps[pos] == '-' ? -999 : alV1[pos]) << "</td>";
+        ofs << "</tr><tr>"<<std::endl;
+        for(int pos = 0; pos < alignedSize; ++pos)
+            ofs << "<td>"<<(steps[pos] == '|' ? -999 : alV2[pos]) << "</td>";
+        ofs <<"</table>"<<std::endl;
+        ofs <<"Introduced "<<2 * alignedSize - mid1.size - mid2.size<<" gaps, score "<<ws.scoreMat[mid1.size * cols + mid2.size];
+    }
+
+private:
+    std::ofstream &ofs;
+};
+
+}
+
 /**
  * @brief Default constructor using default settings.
  */
@@ -151,6 +217,12 @@ void LabelingDataset::parseXMLSettings(rapidxml::xml_node<> *nodeSettings, Setti
             }
         } else if (param == "nw_gap_penalty") {
             s.nw_gap_penalty = parseXMLGetDouble(nodeParam);
+        } else if (param == "nw_gap_penalty_sweep") {
+            s.nw_gap_penalty_sweep = parseXMLGetDoubleList(nodeParam);
+        } else if (param == "nw_band_width") {
+            s.nw_band_width = parseXMLGetInt(nodeParam);
+        } else if (param == "nw_band_adaptive") {
+            s.nw_band_adaptive = parseXMLGetBool(nodeParam);
         } else if (param == "cmp_id_score_cutoff") {
             s.cmp_id_score_cutoff = parseXMLGetDouble(nodeParam);
         } else if (param == "lid_maximal_frag_dev") {
@@ -293,6 +365,39 @@ double LabelingDataset::parseXMLGetDouble(rapidxml::xml_node<> *node, std::strin
     return (float)atof(tmp.c_str());
 }
 
+/**
+ * @brief Parse comma-separated list of numbers, e.g. value="0.1,0.2,0.3"
+ */
+std::vector<double> LabelingDataset::parseXMLGetDoubleList(rapidxml::xml_node<> *node, std::string attr, bool mandatory)
+{
+    std::vector<double> values;
+    rapidxml::xml_attribute<> *a = node->first_attribute(attr.c_str());
+
+    if(!a) {
+        std::stringstream ss;
+        ss<<"Attribute "<<attr<< " not found for node "<<node->name()<<std::endl;
+        std::cerr<<ss.str();
+        //throw LabelingDatasetException(ss.str());
+        return values;
+    }
+
+    std::stringstream list(a->value());
+    std::string tmp;
+    while(std::getline(list, tmp, ',')) {
+        if(tmp.find_first_not_of(" \t") == std::string::npos)
+            continue;
+        // replace "." decimal separator by the one used in current locale
+        size_t ret = tmp.find_first_of('.');
+        if(ret != std::string::npos) {
+            lconv *lconv = localeconv();
+            tmp[ret] = *(lconv->decimal_point);
+        }
+        values.push_back((float)atof(tmp.c_str()));
+    }
+
+    return values;
+}
+
 bool LabelingDataset::parseXMLGetBool(rapidxml::xml_node<> *node, std::string attr, bool mandatory)
 {
     rapidxml::xml_attribute<> *a = node->first_attribute(attr.c_str());
@@ -389,6 +494,8 @@ std::vector<double> LabelingDataset::basePeakNormalization(const std::vector<dou
     for(std::vector<double>::iterator it = vv.begin(); it != vv.end(); ++it) {
         *it /= base;
     }
+
+    return vv;
 }
 
 /**
@@ -454,21 +561,17 @@ void LabelingDataset::distsOverviewHTML(std::string fname) {
     std::cerr<<"writing " << fname<<std::endl;
     ofs.open(fname.c_str());
 
+    MIDDistanceCalculator distCalc(getScoringConfig(settings));
+    std::vector<std::vector<double> > scoringMIDs = getScoringMIDs();
+    HTMLAlignmentTrace trace(ofs);
+
     ofs << "<html>\n<head>\n<title>dists</title>\n</head>\n<body>\n";
     ofs << "<table border=1>";
     for(int i = 0; i < dists.size(); ++i) {
         for(int j = 0; j < dists[i].size(); ++j) {
             if(i >= j) continue;
             ofs <<"<tr><td><img src=\"midplotssingle/"<<i<<".png\"></td><td>"<<dists[i][j]<<"</td><td><img src=\"midplotssingle/"<<j<<".png\"></td>"<<"<td>";
-            if(settings.nw_exclude_m0) { // skip M0
-                ofs << nwHTML<double>(basePeakNormalization(std::vector<double>(&(mids[i][1]), &(mids[i][mids[i].size() - 1]))),
-                        basePeakNormalization(std::vector<double>(&(mids[j][1]), &(mids[j][mids[j].size() - 1]))),
-                        settings.nw_gap_penalty, ofs
-                        );
-            } else {
-                ofs << nwHTML<double>(mids[i], mids[j], settings.nw_gap_penalty, ofs);
-            }
-
+            distCalc.traceMIDDistance(scoringMIDs[i], scoringMIDs[j], trace);
             ofs <<"</td></tr>\n";
         }
     }
@@ -476,7 +579,25 @@ void LabelingDataset::distsOverviewHTML(std::string fname) {
     ofs << "</body>\n";
 }
 
-// TODO: use middistancecalculator
+/**
+ * @brief MIDs as compared by doScoring(): without M0 and base peak normalized if M0 is excluded.
+ */
+std::vector<std::vector<double> > LabelingDataset::getScoringMIDs() const
+{
+    if(!settings.nw_exclude_m0)
+        return mids;
+
+    std::vector<std::vector<double> > scoringMIDs(mids.size());
+    for(int i = 0; i < mids.size(); ++i) {
+        scoringMIDs[i] = basePeakNormalization(std::vector<double>(&(mids[i][1]), &(mids[i][mids[i].size() - 1])));
+    }
+
+    return scoringMIDs;
+}
+
+/**
+ * @brief Calculate the distance matrix of the selected MIDs, using the same alignment engine as LabelingNetworkSet.
+ */
 void LabelingDataset::doScoring()
 {
     // keep some stats on distances:
@@ -484,27 +605,24 @@ void LabelingDataset::doScoring()
     double dMax = 0;
     double dSum = 0;
 
-    // calc needleman-wunsch scores
+    MIDDistanceCalculator distCalc(getScoringConfig(settings));
+    std::vector<std::vector<double> > scoringMIDs = getScoringMIDs();
+    std::vector<MIDView> views(scoringMIDs.begin(), scoringMIDs.end());
+
+    // calc needleman-wunsch scores, each row of the upper half in one go
     dists.resize(mids.size());
     for(int i = 0; i < dists.size(); ++i) {
         dists[i].resize(mids.size());
-        for(int j = 0; j < dists[i].size(); ++j) {
-            if(i == j) { // diagonal
-                dists[i][j] = 1;
-            } else if (i < j) { // do only upper half
-                if(settings.nw_exclude_m0) { // skip M0
-                    dists[i][j] = nw<double>(basePeakNormalization(std::vector<double>(&(mids[i][1]), &(mids[i][mids[i].size() - 1]))),
-                            basePeakNormalization(std::vector<double>(&(mids[j][1]), &(mids[j][mids[j].size() - 1]))),
-                            settings.nw_gap_penalty
-                            );
-                } else {
-                    dists[i][j] = nw<double>(mids[i], mids[j], settings.nw_gap_penalty);
-                }
-                // stats
-                dMin = dists[i][j] < dMin ? dists[i][j] : dMin;
-                dMax = dists[i][j] > dMax ? dists[i][j] : dMax;
-                dSum += dists[i][j];
-            }
+        dists[i][i] = 1; // diagonal
+
+        if(i + 1 < dists.size())
+            distCalc.getMIDDistances(views[i], &views[i + 1], views.size() - i - 1, &dists[i][i + 1]);
+
+        for(int j = i + 1; j < dists[i].size(); ++j) {
+            // stats
+            dMin = dists[i][j] < dMin ? dists[i][j] : dMin;
+            dMax = dists[i][j] > dMax ? dists[i][j] : dMax;
+            dSum += dists[i][j];
         }
     }
     // problem: nw scores not comparable...
@@ -116,9 +116,12 @@ private:
     static std::vector<std::string> parseXMLFileSection(rapidxml::xml_node<> *nodeFiles, bool reportNonExistance = false, std::string curDir = "");
     static int parseXMLGetInt(rapidxml::xml_node<> *node, std::string attr = "value", bool mandatory = true);
     static double parseXMLGetDouble(rapidxml::xml_node<> *node, std::string attr = "value", bool mandatory = true);
+    static std::vector<double> parseXMLGetDoubleList(rapidxml::xml_node<> *node, std::string attr = "value", bool mandatory = true);
     static bool parseXMLGetBool(rapidxml::xml_node<> *node, std::string attr = "value", bool mandatory = true);
     static std::string parseXMLGetString(rapidxml::xml_node<> *node, std::string attr = "value", bool mandatory = true);
 
+    std::vector<std::vector<double> > getScoringMIDs() const;
+
     gcms::LibrarySearch<int,float> *excludeLib;
 };
 
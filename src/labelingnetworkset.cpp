@@ -19,18 +19,100 @@
 //
 
 #include <sstream>
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <set>
+#include <QMutex>
+#include <QWaitCondition>
 #include "labelingnetworkset.h"
+#include "vptree.h"
 #include "misc.h"
 
 namespace mia {
 
-MIDDistanceCalculator *LabelingNetworkSet::distCalc = 0;
+namespace {
+
+// NaN compares neither less nor greater, so such vectors cannot be looked up by value
+bool containsNaN(const std::vector<double> &v)
+{
+    for(size_t i = 0; i < v.size(); ++i)
+        if(std::isnan(v[i]))
+            return true;
+    return false;
+}
+
+/**
+ * @brief Distance of two nodes of a layer for VPTree, calculated like in the distance matrices: lower node index first,
+ * invalid distances are infinite.
+ */
+class NodeDistance
+{
+public:
+    NodeDistance(const MIDDistanceCalculator &distCalc, const std::vector<MIDView> &mids)
+        : distCalc(&distCalc), mids(&mids) {}
+
+    double operator()(int n1, int n2) const
+    {
+        double dist = n1 < n2 ? distCalc->getMIDDistance((*mids)[n1], (*mids)[n2])
+                              : distCalc->getMIDDistance((*mids)[n2], (*mids)[n1]);
+        return std::isnan(dist) ? std::numeric_limits<double>::infinity() : dist;
+    }
+
+private:
+    const MIDDistanceCalculator *distCalc;
+    const std::vector<MIDView> *mids;
+};
+
+const int nearestNeighborQueries = 256; /** Queries per NearestNeighborTask */
+
+// neighbor list entries of the same node, see createNearestNeighborGraphs()
+bool hasSameNode(const std::pair<int, double> &a, const std::pair<int, double> &b)
+{
+    return a.first == b.first;
+}
+
+/**
+ * @brief Nearest neighbor queries of a range of nodes on a thread pool.
+ */
+class NearestNeighborTask : public QRunnable
+{
+public:
+    NearestNeighborTask(const VPTree<NodeDistance> &tree, const std::vector<int> &queries, int begin, int end, int k,
+                        std::vector<std::vector<VPTree<NodeDistance>::Neighbor> > &neighbors, int &calculated)
+        : tree(tree), queries(queries), begin(begin), end(end), k(k), neighbors(neighbors), calculated(calculated) {}
+
+    void run()
+    {
+        for(int i = begin; i < end; ++i)
+            calculated += tree.getNearestNeighbors(queries[i], k, neighbors[queries[i]]);
+    }
+
+private:
+    const VPTree<NodeDistance> &tree;
+    const std::vector<int> &queries;
+    int begin, end, k;
+    std::vector<std::vector<VPTree<NodeDistance>::Neighbor> > &neighbors;
+    int &calculated;
+};
+
+}
 
 LabelingNetworkSet::LabelingNetworkSet()
 {
     excludeM0 = 0;
+    ionPairMode = IP_SELECTED_ION;
+    distanceThreshold = -1;
+    screeningThreshold = -1;
+    skippedAlignments = 0;
+    abandonedAlignments = 0;
+    screenedAlignments = 0;
+    edgeMode = EM_THRESHOLD;
+    nearestNeighborCount = 5;
+    maxEdgesPerNode = 0;
 }
 
+
 LabelingNetworkSet::~LabelingNetworkSet()
 {
     for(int i = 0; i < nodes.size(); ++i) {
@@ -40,6 +122,10 @@ LabelingNetworkSet::~LabelingNetworkSet()
     for(int i = 0; i < datasets.size(); ++i) {
         delete datasets[i];
     }
+
+    for(std::map<std::string, MIDDistanceCalculator *>::iterator it = distCalcs.begin(); it != distCalcs.end(); ++it) {
+        delete it->second;
+    }
 }
 
 void LabelingNetworkSet::exportSelectedMIDs(QTextStream &qout)
@@ -233,17 +319,26 @@ bool LabelingNetworkSet::nodeHasEdges(int n)
             continue;
 
         std::string t = datasets[ds]->getSettings().experiment;
-        std::vector<std::vector<double> > dists = distMats[t];
+
+        if(edgeMode == EM_NEAREST_NEIGHBORS) {
+            const NeighborGraph &graph = neighborGraphs[t];
+            if(n < graph.size() && graph[n].size())
+                connected = true;
+            continue;
+        }
+
+        const DistanceMatrix &dists = distMats[t];
+        const std::vector<std::vector<int> > *closest = getClosestNodes(t);
 
         for(int j = n + 1; j < dists[n].size(); ++j) { // second node
-            if(!std::isnan(dists[n][j]) && dists[n][j] <= datasets[ds]->getSettings().mid_distance_cutoff) {
+            if(!std::isnan(dists[n][j]) && dists[n][j] <= datasets[ds]->getSettings().mid_distance_cutoff && isEdgeKept(closest, n, j)) {
                 connected = true;
                 break;
             }
         }
 
         for(int i = n - 1; i >= 0; --i) { // second node
-            if(!std::isnan(dists[i][n]) && dists[i][n] <= datasets[ds]->getSettings().mid_distance_cutoff) {
+            if(!std::isnan(dists[i][n]) && dists[i][n] <= datasets[ds]->getSettings().mid_distance_cutoff && isEdgeKept(closest, i, n)) {
                 connected = true;
                 break;
             }
@@ -256,86 +351,1412 @@ bool LabelingNetworkSet::nodeHasEdges(int n)
 
 
 /**
-  Create distance matrix map with the different tracers from the nodes vector
+ * @brief Tile of the upper triangle of a layer's distance matrix with empty statistics.
+ */
+LabelingNetworkSet::DistanceTile::DistanceTile(int rowBegin, int rowEnd, int colBegin, int colEnd)
+    : rowBegin(rowBegin), rowEnd(rowEnd), colBegin(colBegin), colEnd(colEnd), dMin(0), dMax(0), dSum(0),
+      skipped(0), abandoned(0), screened(0), cacheHits(0), ionPairs(0), ionPairAlignments(0), reused(0)
+{
+}
+
+/**
+ * @brief Layers whose tiles are all calculated, in order of completion.
+ */
+class LabelingNetworkSet::LayerBuildQueue
+{
+public:
+    void push(LayerBuild *build)
+    {
+        QMutexLocker locker(&mutex);
+        finished.push_back(build);
+        ready.wakeOne();
+    }
+
+    /** Wait for the next finished layer */
+    LayerBuild *take()
+    {
+        QMutexLocker locker(&mutex);
+        while(finished.empty())
+            ready.wait(&mutex);
+        LayerBuild *build = finished.front();
+        finished.pop_front();
+        return build;
+    }
+
+private:
+    QMutex mutex;
+    QWaitCondition ready;
+    std::deque<LayerBuild *> finished;
+};
+
+/**
+ * @brief Runs computeDistanceTile() on a thread pool. The task finishing the last tile of a layer hands the layer over to the waiting thread.
+ */
+class LabelingNetworkSet::DistanceTileTask : public QRunnable
+{
+public:
+    DistanceTileTask(const LabelingNetworkSet *networkSet, LayerBuild &build, DistanceTile &tile, LayerBuildQueue &finished)
+        : networkSet(networkSet), build(build), tile(tile), finished(finished) {}
+
+    void run()
+    {
+        networkSet->computeDistanceTile(build.job, tile);
+        if(!build.pendingTiles.deref())
+            finished.push(&build);
+    }
+
+private:
+    const LabelingNetworkSet *networkSet;
+    LayerBuild &build;
+    DistanceTile &tile;
+    LayerBuildQueue &finished;
+};
+
+/**
+  Create distance matrix map with the different tracers from the nodes vector. The tiles of all layers are calculated concurrently,
+  visible layers first; layerDistancesReady() is emitted from the calling thread for each layer as soon as its matrix is complete.
+  In nearest neighbor mode (see setEdgeMode()), neighbor graphs are created instead (see createNearestNeighborGraphs()).
+  @param earlyAbandon In threshold mode (see setDistanceThreshold), abandon alignments as soon as the distance is known to exceed the threshold
 */
 
-void LabelingNetworkSet::createDistanceMatrices()
+void LabelingNetworkSet::createDistanceMatrices(bool earlyAbandon)
+{
+    buildDistanceMatrices(earlyAbandon, false, 0);
+}
+
+/**
+ * @brief Update the distance matrices after layers were added or removed, nodes were matched again or selected ions changed.
+ *
+ * If the nodes are the same as for the last calculation, only the rows and columns of nodes whose selection changed
+ * (see NodeCompound::isSelectionChanged()) are recalculated in place. Otherwise, distances of node pairs whose prepared MIDs
+ * are unchanged are taken from the previous matrix of the layer; only new layers and the rows and columns of new or changed
+ * nodes are calculated. Layers whose distance settings changed are calculated completely.
+ */
+void LabelingNetworkSet::updateDistanceMatrices()
+{
+    std::vector<int> changedNodes;
+    int n = 0;
+    for(QMap<int, NodeCompound*>::iterator it = nodes.begin(); it != nodes.end(); ++it, ++n) {
+        if(it.value()->isSelectionChanged())
+            changedNodes.push_back(n);
+    }
+    // prepared MIDs of these nodes are stale, e.g. after NodeCompound::setUseLargestCommonIon()
+    if(changedNodes.size())
+        invalidateLayerMIDs();
+
+    buildDistanceMatrices(true, true, distMatNodes == nodes.values() ? &changedNodes : 0);
+}
+
+/**
+ * @brief See createDistanceMatrices() and updateDistanceMatrices().
+ * @param earlyAbandon See createDistanceMatrices()
+ * @param reuseDistances Keep distances of unchanged node pairs
+ * @param changedNodes Nodes whose selection changed if the nodes are unchanged otherwise, or 0
+ */
+void LabelingNetworkSet::buildDistanceMatrices(bool earlyAbandon, bool reuseDistances, const std::vector<int> *changedNodes)
 {
+    if(edgeMode == EM_NEAREST_NEIGHBORS) {
+        createNearestNeighborGraphs();
+        return;
+    }
+    neighborGraphs.clear();
+
     std::cout<<"Creating distance matrics... number of nodes: "<< nodes.size()<<std::endl;
 
-    for(int ds = 0; ds < datasets.size(); ++ds) {
-        if(ds == 0 || datasets[ds]->getSettings().nw_gap_penalty != datasets[ds - 1]->getSettings().nw_gap_penalty) {
-            if(ds) {
-                delete LabelingNetworkSet::distCalc;
+    skippedAlignments = 0;
+    abandonedAlignments = 0;
+    screenedAlignments = 0;
+
+    foreach (NodeCompound *nc, nodes) {
+        nc->clearSelectionChanged();
+    }
+
+    // shared per-layer state (calculators, MIDs, alignment caches) is set up here, tasks only read it
+    std::vector<LayerBuild *> builds;
+    for(int visible = 1; visible >= 0; --visible) {
+        for(int ds = 0; ds < datasets.size(); ++ds) {
+            if(datasets[ds]->isVisible() != visible)
+                continue;
+            // in place if the layer's matrix is otherwise up to date
+            std::string t = datasets[ds]->getSettings().experiment;
+            std::map<std::string, LayerMatrixInputs>::const_iterator prevInputs = distMatInputs.find(t);
+            const std::vector<double> &sweep = datasets[ds]->getSettings().nw_gap_penalty_sweep;
+            if(changedNodes && prevInputs != distMatInputs.end() && prevInputs->second.nodeData.size() == nodes.size()
+                    && prevInputs->second.hasSameSettings(getMatrixSettings(getDistanceCalculator(datasets[ds]->getSettings()), earlyAbandon))
+                    && (sweep.empty() || hasCurrentSweep(t, sweep, nodes.size())))
+                builds.push_back(prepareNodeUpdate(ds, *changedNodes));
+            else
+                builds.push_back(prepareLayerBuild(ds, earlyAbandon, reuseDistances));
+        }
+    }
+    distMatNodes = nodes.values();
+
+    LayerBuildQueue finished;
+    bool parallel = distancePool.maxThreadCount() > 1;
+    if(parallel) {
+        for(int i = 0; i < builds.size(); ++i) {
+            LayerBuild &build = *builds[i];
+            if(build.tiles.empty())
+                finished.push(&build);
+            for(int j = 0; j < build.tiles.size(); ++j)
+                distancePool.start(new DistanceTileTask(this, build, build.tiles[j], finished));
+        }
+    }
+
+    for(int i = 0; i < builds.size(); ++i) {
+        LayerBuild *build = builds[i];
+        if(parallel) {
+            build = finished.take();
+        } else {
+            for(int j = 0; j < build->tiles.size(); ++j)
+                computeDistanceTile(build->job, build->tiles[j]);
+        }
+        finishLayerBuild(*build);
+        emit layerDistancesReady(build->datasetIndex);
+    }
+
+    distancePool.waitForDone();
+    for(int i = 0; i < builds.size(); ++i)
+        delete builds[i];
+
+    std::cout<<"Done creating distance matrics..."<<std::endl;
+}
+
+/**
+ * @brief Nearest neighbor mode: connect each node of a layer to its k nearest nodes (see setNearestNeighborCount()).
+ *
+ * Neighbors are found with a vantage-point tree (see VPTree), so only a fraction of all node pairs is aligned and
+ * no distance matrix is stored. The tree relies on the triangle inequality, which alignment-based distances do not
+ * strictly satisfy, so the neighbors found are approximate. Selected ions are compared regardless of the ion pair mode;
+ * threshold mode, screening and gap penalty sweeps do not apply.
+ */
+void LabelingNetworkSet::createNearestNeighborGraphs()
+{
+    std::cout<<"Creating "<<nearestNeighborCount<<"-nearest-neighbor graphs... number of nodes: "<<nodes.size()<<std::endl;
+
+    skippedAlignments = 0;
+    abandonedAlignments = 0;
+    screenedAlignments = 0;
+
+    foreach (NodeCompound *nc, nodes) {
+        nc->clearSelectionChanged();
+    }
+
+    // switching back to threshold mode needs new matrices
+    distMats.clear();
+    distMatInputs.clear();
+    distMatNodes.clear();
+    closestNodes.clear();
+    distStats.clear();
+    neighborGraphs.clear();
+
+    bool parallel = distancePool.maxThreadCount() > 1;
+    for(int visible = 1; visible >= 0; --visible) {
+        for(int ds = 0; ds < datasets.size(); ++ds) {
+            if(datasets[ds]->isVisible() != visible)
+                continue;
+            const Settings &settings = datasets[ds]->getSettings();
+            std::string t = settings.experiment;
+            std::cout<<"### t = "<<t<<"###\n";
+
+            const MIDDistanceCalculator &distCalc = getDistanceCalculator(settings);
+            const LayerMIDStore &store = getLayerMIDs(t);
+            std::vector<int> queries;
+            for(int n = 0; n < store.hasData.size(); ++n) {
+                if(store.hasData[n])
+                    queries.push_back(n);
+            }
+
+            VPTree<NodeDistance> tree(queries, NodeDistance(distCalc, store.mids));
+
+            std::vector<std::vector<VPTree<NodeDistance>::Neighbor> > neighbors(nodes.size());
+            std::vector<int> calculated((queries.size() + nearestNeighborQueries - 1) / nearestNeighborQueries, 0);
+            for(int i = 0; i < calculated.size(); ++i) {
+                int end = std::min<int>((i + 1) * nearestNeighborQueries, queries.size());
+                NearestNeighborTask *task = new NearestNeighborTask(tree, queries, i * nearestNeighborQueries, end,
+                                                                    nearestNeighborCount, neighbors, calculated[i]);
+                if(parallel) {
+                    distancePool.start(task);
+                } else {
+                    task->run();
+                    delete task;
+                }
+            }
+            distancePool.waitForDone();
+
+            // an edge if either node is among the other's neighbors
+            NeighborGraph &graph = neighborGraphs[t];
+            graph.resize(nodes.size());
+            double dMin = 0;
+            double dMax = 0;
+            for(int n1 = 0; n1 < neighbors.size(); ++n1) {
+                for(int i = 0; i < neighbors[n1].size(); ++i) {
+                    double dist = neighbors[n1][i].first;
+                    int n2 = neighbors[n1][i].second;
+                    if(std::isinf(dist))
+                        continue;
+                    graph[n1].push_back(std::make_pair(n2, dist));
+                    graph[n2].push_back(std::make_pair(n1, dist));
+                    dMax = std::max(dMax, dist);
+                }
+            }
+            size_t edges = 0;
+            for(int n = 0; n < graph.size(); ++n) {
+                // pairs found from both sides may differ in distance, alignments are not symmetric: keep the smaller one
+                std::sort(graph[n].begin(), graph[n].end());
+                graph[n].erase(std::unique(graph[n].begin(), graph[n].end(), hasSameNode), graph[n].end());
+                edges += graph[n].size();
+            }
+            distRanges[t] = std::pair<double, double>(dMin, dMax);
+
+            size_t numCalculated = tree.getBuildDistanceCount();
+            for(int i = 0; i < calculated.size(); ++i)
+                numCalculated += calculated[i];
+            std::cout<<"Neighbors ("<<queries.size()<<"), edges: "<<edges / 2<<"\n\tRange: "<<dMin<<" - "<<dMax<<"\n";
+            std::cout<<"\tCalculated distances: "<<numCalculated<<" (all pairs: "<<queries.size() * (queries.size() - 1) / 2<<")\n";
+
+            emit layerDistancesReady(ds);
+        }
+    }
+
+    std::cout<<"Done creating nearest-neighbor graphs..."<<std::endl;
+}
+
+/**
+ * @brief Threshold mode with edge limit (see setMaxEdgesPerNode()): find each node's closest nodes in the layer's
+ * distance matrix. One pass over the upper triangle offers each distance to a bounded max-heap of both nodes,
+ * so this needs O(n k) memory. Results do not depend on the cutoff: the closest nodes within any cutoff are
+ * among them.
+ */
+void LabelingNetworkSet::findClosestNodes(const std::string &experiment)
+{
+    if(maxEdgesPerNode <= 0) {
+        closestNodes.erase(experiment);
+        return;
+    }
+
+    typedef std::pair<double, int> Neighbor;
+    const DistanceMatrix &dists = distMats[experiment];
+    std::vector<std::priority_queue<Neighbor> > heaps(dists.size()); // farthest kept neighbor on top
+
+    for(int n1 = 0; n1 < dists.size(); ++n1) {
+        const DistanceValue *row = dists[n1].data();
+        for(int n2 = n1 + 1; n2 < dists.size(); ++n2) {
+            double dist = row[n2];
+            if(std::isnan(dist) || std::isinf(dist))
+                continue;
+
+            // ties by node index, so results do not depend on the order of offers
+            Neighbor neighbor1(dist, n2);
+            if(heaps[n1].size() < maxEdgesPerNode) {
+                heaps[n1].push(neighbor1);
+            } else if(neighbor1 < heaps[n1].top()) {
+                heaps[n1].pop();
+                heaps[n1].push(neighbor1);
+            }
+
+            Neighbor neighbor2(dist, n1);
+            if(heaps[n2].size() < maxEdgesPerNode) {
+                heaps[n2].push(neighbor2);
+            } else if(neighbor2 < heaps[n2].top()) {
+                heaps[n2].pop();
+                heaps[n2].push(neighbor2);
+            }
+        }
+    }
+
+    std::vector<std::vector<int> > &closest = closestNodes[experiment];
+    closest.assign(dists.size(), std::vector<int>());
+    for(int n = 0; n < heaps.size(); ++n) {
+        closest[n].reserve(heaps[n].size());
+        for(; !heaps[n].empty(); heaps[n].pop())
+            closest[n].push_back(heaps[n].top().second);
+        std::sort(closest[n].begin(), closest[n].end());
+    }
+}
+
+/**
+ * @brief Closest nodes of a layer as found by findClosestNodes(), 0 if edges are not limited.
+ */
+const std::vector<std::vector<int> > *LabelingNetworkSet::getClosestNodes(const std::string &experiment) const
+{
+    std::map<std::string, std::vector<std::vector<int> > >::const_iterator it = closestNodes.find(experiment);
+    return it == closestNodes.end() ? 0 : &it->second;
+}
+
+/**
+ * @brief Whether the edge of nodes @p n1 and @p n2 is kept under the edge limit: either node is among the other's closest nodes.
+ * @param closest See getClosestNodes()
+ */
+bool LabelingNetworkSet::isEdgeKept(const std::vector<std::vector<int> > *closest, int n1, int n2)
+{
+    if(!closest)
+        return true;
+    return std::binary_search((*closest)[n1].begin(), (*closest)[n1].end(), n2)
+            || std::binary_search((*closest)[n2].begin(), (*closest)[n2].end(), n1);
+}
+
+/**
+ * @brief Set up the calculation of a layer's distance matrix: distance calculator, prepared MIDs, alignment cache and tiles.
+ * Not thread-safe, all shared state the tiles need is created here.
+ * @param datasetIndex Layer
+ * @param earlyAbandon See createDistanceMatrices()
+ * @param reuseDistances Take distances of unchanged node pairs from the previous matrix, if it was calculated with the same settings
+ */
+LabelingNetworkSet::LayerBuild *LabelingNetworkSet::prepareLayerBuild(int datasetIndex, bool earlyAbandon, bool reuseDistances)
+{
+    const MIDDistanceCalculator &distCalc = getDistanceCalculator(datasets[datasetIndex]->getSettings());
+
+    std::string t = datasets[datasetIndex]->getSettings().experiment;
+
+    // MIDs as used for distance calculation, prepared once per layer
+    const LayerMIDStore &store = getLayerMIDs(t);
+
+    LayerBuild *build = new LayerBuild();
+    build->datasetIndex = datasetIndex;
+    build->inPlace = false;
+
+    LayerMatrixInputs &inputs = build->inputs;
+    inputs = getMatrixSettings(distCalc, earlyAbandon);
+    inputs.nodeData.resize(nodes.size());
+    for(int i = 0; i < nodes.size(); ++i)
+        getNodeData(store, i, inputs.nodeData[i]);
+
+    // find unchanged nodes in the previous matrix by their MIDs, they keep their distances
+    std::vector<int> &previousRows = build->previousRows;
+    previousRows.assign(nodes.size(), -1);
+    const DistanceMatrix *previous = 0;
+    std::map<std::string, LayerMatrixInputs>::const_iterator prevInputs = distMatInputs.find(t);
+    if(reuseDistances && prevInputs != distMatInputs.end() && prevInputs->second.hasSameSettings(inputs)) {
+        previous = &distMats[t];
+        std::map<std::vector<double>, int> rows;
+        for(int i = 0; i < prevInputs->second.nodeData.size(); ++i)
+            if(!containsNaN(prevInputs->second.nodeData[i]))
+                rows.insert(std::make_pair(prevInputs->second.nodeData[i], i));
+        for(int i = 0; i < nodes.size(); ++i) {
+            if(containsNaN(inputs.nodeData[i]))
+                continue; // not comparable
+            std::map<std::vector<double>, int>::const_iterator row = rows.find(inputs.nodeData[i]);
+            if(row != rows.end())
+                previousRows[i] = row->second;
+        }
+    }
+
+    std::vector<bool> &cached = build->cached;
+    AlignmentCache *cache = prepareAlignmentCache(datasetIndex, store, previous, previousRows, cached);
+
+    // pairs without data keep DS_NO_DATA
+    build->status.assign(nodes.size() * (nodes.size() - 1) / 2, DS_NO_DATA);
+
+    DistanceMatrix &dists = build->dists;
+    dists.resize(nodes.size());
+    for(int n1 = 0; n1 < dists.size(); ++n1) {
+        dists[n1].resize(dists.size());
+        dists[n1][n1] = 1; // diagonal
+
+        // no data or above threshold
+        for(int n2 = n1 + 1; n2 < dists.size(); ++n2) // do only upper half
+            dists[n1][n2] = std::numeric_limits<DistanceValue>::infinity();
+    }
+
+    LayerDistanceJob &job = build->job;
+    job.distCalc = &distCalc;
+    job.store = &store;
+    job.cache = cache;
+    job.cached = &cached;
+    job.dists = &dists;
+    job.abandonThreshold = inputs.abandonThreshold;
+    job.previous = previous;
+    job.previousRows = &previousRows;
+    job.status = &build->status;
+    job.previousStatus = previous ? &distStats[t].status : 0;
+
+    // additional gap penalties requested in project file, calculated by the same tiles
+    const std::vector<double> &sweep = datasets[datasetIndex]->getSettings().nw_gap_penalty_sweep;
+    if(sweep.size()) {
+        std::map<double, std::vector<std::vector<double> > > &mats = sweepDistMats[t];
+        if(previous && hasCurrentSweep(t, sweep, previous->size()))
+            build->previousSweep.swap(mats);
+        mats.clear();
+        job.sweepGapPenalties = sweep;
+        for(int g = 0; g < sweep.size(); ++g) {
+            std::vector<std::vector<double> > &mat = mats[sweep[g]];
+            mat.resize(nodes.size());
+            for(int n1 = 0; n1 < mat.size(); ++n1) {
+                mat[n1].assign(mat.size(), 0);
+                mat[n1][n1] = 1; // diagonal
+                std::fill(mat[n1].begin() + n1 + 1, mat[n1].end(), std::numeric_limits<double>::infinity()); // do only upper half
+            }
+            job.sweepDists.push_back(&mat);
+            if(build->previousSweep.size())
+                job.previousSweepDists.push_back(&build->previousSweep[sweep[g]]);
+        }
+    }
+
+    // needleman-wunsch scores: upper triangle in tiles
+    for(int r = 0; r < dists.size(); r += distanceTileSize) {
+        for(int c = r; c < dists.size(); c += distanceTileSize) {
+            build->tiles.push_back(DistanceTile(r, std::min<int>(r + distanceTileSize, dists.size()),
+                                                c, std::min<int>(c + distanceTileSize, dists.size())));
+        }
+    }
+    build->pendingTiles.store(build->tiles.size());
+
+    return build;
+}
+
+/**
+ * @brief Set up recalculating the rows and columns of changed nodes of a layer's distance matrix in place. The matrix must
+ * have been calculated for the same nodes and settings. Nodes whose prepared MIDs turn out to be unchanged are skipped.
+ * Not thread-safe, see prepareLayerBuild().
+ * @param datasetIndex Layer
+ * @param changedNodes Candidate nodes, ascending
+ */
+LabelingNetworkSet::LayerBuild *LabelingNetworkSet::prepareNodeUpdate(int datasetIndex, const std::vector<int> &changedNodes)
+{
+    const MIDDistanceCalculator &distCalc = getDistanceCalculator(datasets[datasetIndex]->getSettings());
+    std::string t = datasets[datasetIndex]->getSettings().experiment;
+    const LayerMIDStore &store = getLayerMIDs(t);
+    const LayerMatrixInputs &prevInputs = distMatInputs[t];
+    DistanceMatrix &dists = distMats[t];
+    const std::pair<double, double> &range = distRanges[t];
+    LayerDistanceStats &stats = distStats[t];
+
+    LayerBuild *build = new LayerBuild();
+    build->datasetIndex = datasetIndex;
+    build->inPlace = true;
+    build->rangeMayShrink = false;
+
+    LayerMatrixInputs &inputs = build->inputs;
+    inputs = prevInputs;
+    std::vector<int> changed;
+    for(int i = 0; i < changedNodes.size(); ++i) {
+        int n = changedNodes[i];
+        getNodeData(store, n, inputs.nodeData[n]);
+        if(inputs.nodeData[n] != prevInputs.nodeData[n] || containsNaN(inputs.nodeData[n]))
+            changed.push_back(n);
+    }
+    build->changedNodes = changed.size();
+
+    std::vector<bool> &cached = build->cached;
+    AlignmentCache *cache = prepareAlignmentCache(datasetIndex, store, 0, build->previousRows, cached);
+
+    // forget the old distances of changed nodes, check whether they could have defined the range
+    std::vector<bool> isChanged(nodes.size(), false);
+    for(int i = 0; i < changed.size(); ++i)
+        isChanged[changed[i]] = true;
+    for(int i = 0; i < changed.size(); ++i) {
+        int n1 = changed[i];
+        for(int n2 = 0; n2 < nodes.size(); ++n2) {
+            if(n2 == n1 || (isChanged[n2] && n2 < n1))
+                continue; // diagonal or done
+            DistanceValue &dist = n1 < n2 ? dists[n1][n2] : dists[n2][n1];
+            unsigned char &status = stats.status[alignmentCacheIndex(std::min(n1, n2), std::max(n1, n2), nodes.size())];
+            switch(status) {
+            case DS_CALCULATED:
+                if(dist <= range.first || dist >= range.second)
+                    build->rangeMayShrink = true;
+                break;
+            case DS_SKIPPED:
+                --stats.skipped;
+                // may have raised the maximum to the threshold
+                if(range.second <= distanceThreshold)
+                    build->rangeMayShrink = true;
+                break;
+            case DS_ABANDONED:
+                --stats.abandoned;
+                if(range.second <= distanceThreshold)
+                    build->rangeMayShrink = true;
+                break;
+            case DS_SCREENED:
+                --stats.screened;
+                break;
+            }
+            stats.sketch.remove(dist);
+            dist = std::numeric_limits<DistanceValue>::infinity();
+            status = DS_NO_DATA;
+        }
+    }
+
+    LayerDistanceJob &job = build->job;
+    job.distCalc = &distCalc;
+    job.store = &store;
+    job.cache = cache;
+    job.cached = &cached;
+    job.dists = &dists;
+    job.abandonThreshold = inputs.abandonThreshold;
+    job.previous = 0;
+    job.previousRows = &build->previousRows;
+    job.status = &stats.status;
+    job.previousStatus = 0;
+
+    // gap penalty sweep is up to date except for the changed nodes, see buildDistanceMatrices()
+    const std::vector<double> &sweep = datasets[datasetIndex]->getSettings().nw_gap_penalty_sweep;
+    if(sweep.size()) {
+        job.sweepGapPenalties = sweep;
+        for(int g = 0; g < sweep.size(); ++g) {
+            std::vector<std::vector<double> > &mat = sweepDistMats[t][sweep[g]];
+            for(int i = 0; i < changed.size(); ++i) {
+                int n1 = changed[i];
+                for(int n2 = 0; n2 < nodes.size(); ++n2) {
+                    if(n2 != n1)
+                        (n1 < n2 ? mat[n1][n2] : mat[n2][n1]) = std::numeric_limits<double>::infinity();
+                }
+            }
+            job.sweepDists.push_back(&mat);
+        }
+    }
+
+    // row of each changed node right of the diagonal, column above the diagonal without rows of other changed nodes
+    for(int i = 0; i < changed.size(); ++i) {
+        int n = changed[i];
+        if(n + 1 < nodes.size())
+            build->tiles.push_back(DistanceTile(n, n + 1, n + 1, nodes.size()));
+        int r = 0;
+        for(int j = 0; j <= i; ++j) {
+            if(r < changed[j])
+                build->tiles.push_back(DistanceTile(r, changed[j], n, n + 1));
+            r = changed[j] + 1;
+        }
+    }
+    build->pendingTiles.store(build->tiles.size());
+
+    return build;
+}
+
+/**
+ * @brief Settings of a layer's distance matrix calculation, without node data.
+ */
+LabelingNetworkSet::LayerMatrixInputs LabelingNetworkSet::getMatrixSettings(const MIDDistanceCalculator &distCalc, bool earlyAbandon) const
+{
+    LayerMatrixInputs inputs;
+    inputs.config = distCalc.getConfig();
+    inputs.ionPairMode = ionPairMode;
+    inputs.distanceThreshold = distanceThreshold;
+    inputs.abandonThreshold = earlyAbandon ? distanceThreshold : -1;
+    inputs.screeningThreshold = screeningThreshold;
+    return inputs;
+}
+
+/**
+ * @brief Whether distance calculation keeps alignment paths (see AlignmentCache). Only the selected ion mode reads them,
+ * and as each path takes twice the memory of a distance, they are not kept for layers of more than alignmentCacheMaxNodes
+ * nodes or if distances are stored in single precision to save memory.
+ */
+bool LabelingNetworkSet::useAlignmentCache() const
+{
+#ifdef MIA_WITH_FLOAT_DISTANCES
+    return false;
+#else
+    return ionPairMode == IP_SELECTED_ION && nodes.size() <= alignmentCacheMaxNodes;
+#endif
+}
+
+/**
+ * @brief Prepare the alignment cache of a layer for the current nodes and MIDs. Drops the layer's cache if
+ * useAlignmentCache() is false.
+ * @param datasetIndex Layer
+ * @param store Prepared MIDs of the layer
+ * @param previous Previous distance matrix if nodes were matched again, or 0
+ * @param previousRows Row of each node in @p previous, see LayerDistanceJob
+ * @param cached Output: whether the cached paths of a node are valid, by node index
+ * @return The layer's cache, or 0 if not used
+ */
+LabelingNetworkSet::AlignmentCache *LabelingNetworkSet::prepareAlignmentCache(int datasetIndex, const LayerMIDStore &store, const DistanceMatrix *previous,
+                                                                               const std::vector<int> &previousRows, std::vector<bool> &cached)
+{
+    const std::vector<MIDView> &mids = store.mids;
+    std::string t = datasets[datasetIndex]->getSettings().experiment;
+
+    if(!useAlignmentCache()) {
+        alignmentCaches.erase(t);
+        cached.clear();
+        return 0;
+    }
+
+    // reuse alignment paths of this layer where gap penalty and MIDs are unchanged
+    AlignmentCache &cache = alignmentCaches[t];
+    double gapPenalty = datasets[datasetIndex]->getSettings().nw_gap_penalty;
+    QList<int> nodeIds = nodes.keys();
+    if(previous && cache.gapPenalty == gapPenalty && cache.mids.size() == previous->size()) {
+        // nodes were matched again: move paths of unchanged pairs to their new place
+        AlignmentCache moved;
+        moved.gapPenalty = gapPenalty;
+        moved.nodeIds = nodeIds;
+        moved.mids.resize(nodes.size());
+        moved.paths.resize(nodes.size() * (nodes.size() - 1) / 2);
+        for(int n1 = 0; n1 < nodes.size(); ++n1) {
+            int o1 = previousRows[n1];
+            if(o1 < 0)
+                continue;
+            moved.mids[n1] = cache.mids[o1];
+            for(int n2 = n1 + 1; n2 < nodes.size(); ++n2) {
+                int o2 = previousRows[n2];
+                if(o1 < o2) // paths are not symmetric
+                    moved.paths[alignmentCacheIndex(n1, n2, nodes.size())] = cache.paths[alignmentCacheIndex(o1, o2, cache.mids.size())];
             }
-            LabelingNetworkSet::distCalc = new MIDDistanceCalculator(datasets[ds]->getSettings().nw_gap_penalty); // TODO reuse if same gap penalty
         }
+        std::swap(cache, moved);
+    }
+    if(cache.gapPenalty != gapPenalty || cache.nodeIds != nodeIds) {
+        cache.gapPenalty = gapPenalty;
+        cache.nodeIds = nodeIds;
+        cache.mids.assign(nodes.size(), std::vector<double>());
+        cache.paths.assign(nodes.size() * (nodes.size() - 1) / 2, AlignmentPath());
+    }
+    cached.resize(nodes.size());
+    for(int i = 0; i < nodes.size(); ++i) {
+        cached[i] = cache.mids[i].size() == mids[i].size && std::equal(mids[i].data, mids[i].data + mids[i].size, cache.mids[i].begin());
+        cache.mids[i].assign(mids[i].data, mids[i].data + mids[i].size);
+    }
+
+    return &cache;
+}
+
+/**
+ * @brief Combine the statistics of a layer's tiles and store its distance matrix and range. The gap penalty sweep
+ * is already stored by the tiles (see computeSweepTile()).
+ */
+void LabelingNetworkSet::finishLayerBuild(LayerBuild &build)
+{
+    const MIDDistanceCalculator &distCalc = *build.job.distCalc;
+    const DistanceMatrix &dists = *build.job.dists;
+    std::string t = datasets[build.datasetIndex]->getSettings().experiment;
+    std::cout<<"### t = "<<t<<"###\n";
+
+    // combine in tile order, so results do not depend on scheduling or number of threads
+    double dMin = 0;
+    double dMax = 0;
+    double dSum = 0;
+    int skipped = 0;
+    int abandoned = 0;
+    int screened = 0;
+    int cacheHits = 0;
+    int ionPairs = 0;
+    int ionPairAlignments = 0;
+    int reused = 0;
+    LayerDistanceStats &stats = distStats[t];
+    if(!build.inPlace)
+        stats.sketch.clear();
+    for(int i = 0; i < build.tiles.size(); ++i) {
+        const DistanceTile &tile = build.tiles[i];
+        dMin = std::min(dMin, tile.dMin);
+        dMax = std::max(dMax, tile.dMax);
+        dSum += tile.dSum;
+        skipped += tile.skipped;
+        abandoned += tile.abandoned;
+        screened += tile.screened;
+        cacheHits += tile.cacheHits;
+        ionPairs += tile.ionPairs;
+        ionPairAlignments += tile.ionPairAlignments;
+        reused += tile.reused;
+        stats.sketch.merge(tile.sketch);
+    }
+    size_t numWithData = std::count(build.job.store->hasData.begin(), build.job.store->hasData.end(), true);
+    stats.pairs = numWithData * (numWithData - 1) / 2;
+    // pairs left infinite, the counts of replaced pairs were removed by prepareNodeUpdate()
+    if(build.inPlace) {
+        stats.skipped += skipped;
+        stats.abandoned += abandoned;
+        stats.screened += screened;
+    } else {
+        stats.status.swap(build.status);
+        stats.skipped = skipped;
+        stats.abandoned = abandoned;
+        stats.screened = screened;
+    }
 
+    // skipped distances are above the threshold, keep relative cutoffs meaningful
+    if(stats.skipped || stats.abandoned)
+        dMax = std::max(dMax, distanceThreshold);
+    skippedAlignments += stats.skipped;
+    abandonedAlignments += stats.abandoned;
+    screenedAlignments += stats.screened;
+    double dMean = dSum / (dists.size() * (dists.size() - 1));
+    std::cout<<"Using "<<distCalc.getConfig().getDistanceMeasure()<<" / "<<distCalc.getConfig().getDistanceNormalization()<<" / gap penalty "<<distCalc.getConfig().getGapPenalty();
+    if(distCalc.getConfig().getBandWidth() > 0)
+        std::cout<<" / band width "<<distCalc.getConfig().getBandWidth()<<(distCalc.getConfig().isAdaptiveBand() ? " (adaptive)" : "");
+    std::cout<<std::endl;
+    if(build.inPlace) {
+        // replaced distances did not define the range, so the new ones can only widen it
+        if(build.rangeMayShrink) {
+            std::pair<double, double> range = getDistanceRange(dists, build.job.store->hasData, stats);
+            dMin = range.first;
+            dMax = range.second;
+        } else {
+            dMin = std::min(dMin, distRanges[t].first);
+            dMax = std::max(dMax, distRanges[t].second);
+        }
+        std::cout<< "Distances ("<<dists.size()<<"), updated for "<<build.changedNodes<<" nodes\n\tRange: "<<dMin<<" - "<<dMax<<"\n";
+    } else {
+        std::cout<< "Distances ("<<dists.size()<<")\n\tRange: "<<dMin<<" - "<<dMax<<"\n\tMean: "<<dMean<<"\n";
+    }
+    std::cout<<"\tReused alignments: "<<cacheHits<<"\n";
+    if(build.job.previous)
+        std::cout<<"\tReused distances: "<<reused<<"\n";
+    if(ionPairMode != IP_SELECTED_ION)
+        std::cout<<"\tIon pairs: "<<ionPairs<<", aligned: "<<ionPairAlignments<<"\n";
+    if(distanceThreshold >= 0)
+        std::cout<<"\tSkipped alignments (threshold "<<distanceThreshold<<"): "<<stats.skipped<<", abandoned: "<<stats.abandoned<<"\n";
+    if(screeningThreshold >= 0)
+        std::cout<<"\tScreened out (EMD above "<<screeningThreshold<<"): "<<stats.screened<<"\n";
+    if(build.job.sweepGapPenalties.size())
+        std::cout<<"\tGap penalty sweep: "<<sweepDistMats[t].size()<<" distance matrices\n";
+
+    if(!build.inPlace)
+        distMats[t].swap(build.dists);
+    std::swap(distMatInputs[t], build.inputs);
+    distRanges[t] = std::pair<double, double>(dMin, dMax);
+    findClosestNodes(t);
+}
+
+/**
+ * @brief Distance range of a layer's complete distance matrix as createDistanceMatrices() determines it: minimum and maximum
+ * distance, the maximum raised to the threshold if pairs were skipped or abandoned in threshold mode.
+ * @param stats Statistics of the layer with the final counts of skipped and abandoned pairs.
+ */
+std::pair<double, double> LabelingNetworkSet::getDistanceRange(const DistanceMatrix &dists, const std::vector<bool> &hasData, const LayerDistanceStats &stats) const
+{
+    double dMin = 0;
+    double dMax = 0;
+    for(int n1 = 0; n1 < dists.size(); ++n1) {
+        if(!hasData[n1])
+            continue;
+        for(int n2 = n1 + 1; n2 < dists.size(); ++n2) {
+            if(!hasData[n2])
+                continue;
+            double dist = dists[n1][n2];
+            if(std::isinf(dist))
+                continue;
+            dMin = std::min(dMin, dist);
+            dMax = std::max(dMax, dist);
+        }
+    }
+    if(distanceThreshold >= 0 && (stats.skipped || stats.abandoned))
+        dMax = std::max(dMax, distanceThreshold);
+
+    return std::pair<double, double>(dMin, dMax);
+}
+
+/**
+ * @brief Create distance matrices of all layers for several gap penalties in a single pass over all node pairs.
+ * MIDs are prepared once and each pair is aligned for all gap penalties at the same time
+ * (see MIDDistanceCalculator::getMIDDistances(const MIDView &, const MIDView *, int, const double *, int, double **) const).
+ * Threshold mode and alignment caches are not used. Results are available from getDistanceMatrixSweep().
+ * @param gapPenalties Gap penalties to create distance matrices for.
+ */
+void LabelingNetworkSet::createDistanceMatrixSweep(const std::vector<double> &gapPenalties)
+{
+    for(int ds = 0; ds < datasets.size(); ++ds) {
         std::string t = datasets[ds]->getSettings().experiment;
-        std::cout<<"### t = "<<t<<"###\n";
-
-        // do scoring
-        // keep some stats on distances:
-        double dMin = 0;
-        double dMax = 0;
-        double dSum = 0;
-
-        std::vector<std::vector<double> > dists;
-        // calc needleman-wunsch scores
-        dists.resize(nodes.size());
-
-        int n1 = 0;
-        for(QMap<int, NodeCompound*>::iterator it1 = nodes.begin(); it1 != nodes.end(); ++it1) {
-            dists[n1].resize(dists.size());
-
-            NodeCompound *node1 = it1.value();
-            std::vector<double> mid1 = std::vector<double>();
-            if(node1->hasDataForExperiment(t)) {
-                mid1 = node1->getSelectedMID(t);
-            }
-
-            int n2 = 0;
-            for(QMap<int, NodeCompound*>::iterator it2 = nodes.begin(); it2 != nodes.end(); ++it2) {
-                NodeCompound *node2 = it2.value();
-                std::vector<double> mid2 = std::vector<double>();
-                if(node2->hasDataForExperiment(t)) {
-                    mid2 = node2->getSelectedMID(t);
+        const LayerMIDStore &store = getLayerMIDs(t);
+        createLayerDistanceMatrixSweep(getDistanceCalculator(datasets[ds]->getSettings()), t, gapPenalties, store.mids, store.hasData);
+    }
+}
+
+/**
+ * @brief Distance matrices of the given layer by gap penalty, as created by the last createDistanceMatrixSweep()
+ * or along with the distance matrix from the layer's nw_gap_penalty_sweep setting.
+ */
+std::map<double, std::vector<std::vector<double> > > LabelingNetworkSet::getDistanceMatrixSweep(const std::string &experiment) const
+{
+    std::map<std::string, std::map<double, std::vector<std::vector<double> > > >::const_iterator it = sweepDistMats.find(experiment);
+    if(it == sweepDistMats.end())
+        return std::map<double, std::vector<std::vector<double> > >();
+    return it->second;
+}
+
+/**
+ * @brief Get MIDs of all nodes as used for distance calculation in the given layer. Built on first use after invalidateLayerMIDs(),
+ * each selected MID and its confidence intervals are copied and prepared (see prepareMID(), prepareCI()) exactly once.
+ * @param experiment Layer name
+ * @return Prepared MIDs by node index
+ */
+const LabelingNetworkSet::LayerMIDStore &LabelingNetworkSet::getLayerMIDs(const std::string &experiment)
+{
+    LayerMIDStore &store = midStores[experiment];
+    const bool needIons = ionPairMode != IP_SELECTED_ION;
+    if(store.valid && (store.hasIons || !needIons))
+        return store;
+
+    store.data.clear();
+    store.hasData.assign(nodes.size(), false);
+    std::vector<size_t> offsets(nodes.size() + 1, 0);
+    int n = 0;
+    for(QMap<int, NodeCompound*>::iterator it = nodes.begin(); it != nodes.end(); ++it, ++n) {
+        NodeCompound *node = it.value();
+        if(node->hasDataForExperiment(experiment)) {
+            std::vector<double> mid = node->getSelectedMID(experiment);
+            store.hasData[n] = mid.size();
+            appendPreparedMID(store.data, mid, node->getSelectedCI(experiment), excludeM0);
+        }
+        offsets[n + 1] = store.data.size();
+    }
+
+    // all labeled ions after the selected ones, so these stay contiguous
+    std::vector<size_t> ionOffsets(1, store.data.size());
+    store.ionBegin.assign(nodes.size() + 1, 0);
+    store.ionWeights.clear();
+    if(needIons) {
+        n = 0;
+        for(QMap<int, NodeCompound*>::iterator it = nodes.begin(); it != nodes.end(); ++it, ++n) {
+            NodeCompound *node = it.value();
+            if(store.hasData[n]) {
+                std::vector<std::vector<double> > mids = node->getMIDs(experiment);
+                std::vector<std::vector<double> > cis = node->getCIs(experiment);
+                std::vector<double> r2s = node->getR2s(experiment);
+                for(int i = 0; i < mids.size(); ++i) {
+                    if(!mids[i].size())
+                        continue;
+                    appendPreparedMID(store.data, mids[i], i < cis.size() ? cis[i] : std::vector<double>(), excludeM0);
+                    ionOffsets.push_back(store.data.size());
+                    store.ionWeights.push_back(i < r2s.size() ? std::max(0.0, r2s[i]) : 0);
                 }
-                if(n1 == n2) { // diagonal
-                    dists[n1][n2] = 1;
-                } else if (n1 < n2) { // do only upper half
-                    if(mid1.size() && mid2.size()) {
-                        double dist = getDistance(mid1, mid2, excludeM0);
+            }
+            store.ionBegin[n + 1] = store.ionWeights.size();
+        }
+    }
+
+    // data does not move anymore; each block holds MID and confidence intervals of equal length
+    store.mids.resize(nodes.size());
+    for(int i = 0; i < nodes.size(); ++i) {
+        int size = (offsets[i + 1] - offsets[i]) / 2;
+        store.mids[i] = MIDView(store.data.data() + offsets[i], size, store.data.data() + offsets[i] + size);
+    }
+    store.ions.resize(store.ionWeights.size());
+    store.ionSums.resize(store.ionWeights.size());
+    for(int i = 0; i < store.ions.size(); ++i) {
+        int size = (ionOffsets[i + 1] - ionOffsets[i]) / 2;
+        store.ions[i] = MIDView(store.data.data() + ionOffsets[i], size, store.data.data() + ionOffsets[i] + size);
+        store.ionSums[i] = MIDSums(store.ions[i]);
+    }
+
+    store.valid = true;
+    store.hasIons = needIons;
+    return store;
+}
+
+/**
+ * @brief Append a MID and its confidence intervals, both prepared for distance calculation (see prepareMID(), prepareCI()), to @p data.
+ * @param data Destination
+ * @param mid MID
+ * @param ci Confidence intervals of @p mid, missing intervals count as exact
+ * @param excludeM0 M0 handling
+ */
+void LabelingNetworkSet::appendPreparedMID(std::vector<double> &data, std::vector<double> mid, std::vector<double> ci, int excludeM0)
+{
+    ci.resize(mid.size());
+    // CIs first, preparing them needs the original MID
+    MIDView preparedCI = prepareCI(mid, ci, excludeM0, ci.data());
+    MIDView prepared = prepareMID(mid, excludeM0, mid.data());
+    data.insert(data.end(), prepared.data, prepared.data + prepared.size);
+    data.insert(data.end(), preparedCI.data, preparedCI.data + preparedCI.size);
+}
+
+/**
+ * @brief Calculate the distances of one tile of a layer's distance matrix, cells right of the diagonal only, and collect
+ * the tile's statistics. Tiles write disjoint cells of the matrix and the alignment cache, so they may run concurrently.
+ * @param job Layer inputs and output matrix
+ * @param tile Rows and columns to process, receives the statistics
+ */
+void LabelingNetworkSet::computeDistanceTile(const LayerDistanceJob &job, DistanceTile &tile) const
+{
+    const MIDDistanceCalculator &distCalc = *job.distCalc;
+    const LayerMIDStore &store = *job.store;
+    const std::vector<MIDView> &mids = store.mids;
+    const std::vector<bool> &hasData = store.hasData;
+    const std::vector<bool> &cached = *job.cached;
+    DistanceMatrix &dists = *job.dists;
+    std::vector<unsigned char> &status = *job.status;
+    const double abandonThreshold = job.abandonThreshold;
+
+    // align each row of the tile in one go
+    std::vector<int> rowNodes;
+    std::vector<int> skippedNodes;
+    std::vector<double> rowDists;
+    std::vector<MIDView> alignMIDs;
+    std::vector<int> alignRowIdx;
+    std::vector<double> alignDists;
+    std::vector<AlignmentPath> alignPaths;
+    rowNodes.reserve(tile.colEnd - tile.colBegin);
+    rowDists.reserve(tile.colEnd - tile.colBegin);
+
+    for(int n1 = tile.rowBegin; n1 < tile.rowEnd; ++n1) {
+        if(!hasData[n1])
+            continue;
+        const int colBegin = std::max(tile.colBegin, n1 + 1); // do only upper half
+
+        rowNodes.clear();
+        rowDists.clear();
+        alignMIDs.clear();
+        alignRowIdx.clear();
+        if(ionPairMode != IP_SELECTED_ION) {
+            for(int n2 = colBegin; n2 < tile.colEnd; ++n2) {
+                if(!hasData[n2] || reuseDistance(job, n1, n2, tile))
+                    continue;
+                // screening by the selected ions
+                if(screeningThreshold >= 0 && distCalc.getEMDDistance(mids[n1], mids[n2]) > screeningThreshold) {
+                    ++tile.screened;
+                    status[alignmentCacheIndex(n1, n2, dists.size())] = DS_SCREENED;
+                    continue;
+                }
+                rowNodes.push_back(n2);
+            }
+            skippedNodes.clear();
+            getIonPairDistances(distCalc, store, n1, rowNodes, rowDists, abandonThreshold, skippedNodes, tile.ionPairs, tile.ionPairAlignments);
+            tile.skipped += skippedNodes.size();
+            for(int s = 0; s < skippedNodes.size(); ++s)
+                status[alignmentCacheIndex(n1, skippedNodes[s], dists.size())] = DS_SKIPPED;
+        } else {
+            AlignmentPath *rowPaths = job.cache ? job.cache->paths.data() + alignmentCacheIndex(n1, n1 + 1, dists.size()) : 0;
+            for(int n2 = colBegin; n2 < tile.colEnd; ++n2) {
+                if(!hasData[n2] || reuseDistance(job, n1, n2, tile))
+                    continue;
+                // threshold mode: skip pairs which can never be connected
+                if(distanceThreshold >= 0 && distCalc.getDistanceLowerBound(mids[n1], mids[n2]) > distanceThreshold) {
+                    ++tile.skipped;
+                    status[alignmentCacheIndex(n1, n2, dists.size())] = DS_SKIPPED;
+                    continue;
+                }
+                // screening: skip pairs which are far apart without alignment
+                if(screeningThreshold >= 0 && distCalc.getEMDDistance(mids[n1], mids[n2]) > screeningThreshold) {
+                    ++tile.screened;
+                    status[alignmentCacheIndex(n1, n2, dists.size())] = DS_SCREENED;
+                    continue;
+                }
+                if(rowPaths && cached[n1] && cached[n2] && rowPaths[n2 - n1 - 1].isValid()) {
+                    // only measure changed
+                    rowDists.push_back(distCalc.getMIDDistance(mids[n1], mids[n2], rowPaths[n2 - n1 - 1]));
+                    ++tile.cacheHits;
+                } else {
+                    alignRowIdx.push_back(rowDists.size());
+                    alignMIDs.push_back(mids[n2]);
+                    rowDists.push_back(0);
+                }
+                rowNodes.push_back(n2);
+            }
+
+            alignDists.resize(alignMIDs.size());
+            alignPaths.resize(alignMIDs.size());
+            distCalc.getMIDDistances(mids[n1], alignMIDs.data(), alignMIDs.size(), alignDists.data(), abandonThreshold, rowPaths ? alignPaths.data() : 0);
+            for(int a = 0; a < alignRowIdx.size(); ++a) {
+                int r = alignRowIdx[a];
+                rowDists[r] = alignDists[a];
+                if(rowPaths)
+                    rowPaths[rowNodes[r] - n1 - 1] = alignPaths[a];
+            }
+        }
+
+        for(int r = 0; r < rowNodes.size(); ++r) {
+            int n2 = rowNodes[r];
+            double dist = rowDists[r];
+
+            if(abandonThreshold >= 0 && std::isinf(dist)) {
+                ++tile.abandoned;
+                status[alignmentCacheIndex(n1, n2, dists.size())] = DS_ABANDONED;
+                continue;
+            }
+            status[alignmentCacheIndex(n1, n2, dists.size())] = DS_CALCULATED;
 
 #ifdef MIAMAINWINDOW_H_ENABLE_ZSCORE
-                        if(useZScore->checkState() == Qt::Checked) {
-                            dist = distCalc->getMonteCarloZScore(dist, mid1.size(), mid2.size());
-                        }
+            if(useZScore->checkState() == Qt::Checked) {
+                dist = distCalc.getMonteCarloZScore(dist, mids[n1].size, mids[n2].size);
+            }
 #endif
 
-                        dists[n1][n2] = dist;
+            dists[n1][n2] = dist;
 
-                        // stats
-                        dMin = dist < dMin ? dist : dMin;
-                        dMax = dist > dMax ? dist : dMax;
-                        dSum += dist;
-                    } else {
-                        dists[n1][n2] = std::numeric_limits<double>::infinity();
-                    }
+            // stats
+            tile.sketch.add(dists[n1][n2]);
+            tile.dMin = dist < tile.dMin ? dist : tile.dMin;
+            tile.dMax = dist > tile.dMax ? dist : tile.dMax;
+            tile.dSum += dist;
+        }
+    }
+
+    computeSweepTile(job, tile);
+}
+
+/**
+ * @brief Calculate the gap penalty sweep distances of one tile (see LayerDistanceJob::sweepGapPenalties), aligning each row
+ * of the tile for all gap penalties in one go. Threshold mode, screening and alignment caches do not apply, distances of
+ * unchanged node pairs are taken from the previous sweep like in reuseDistance().
+ * @param job Layer inputs and output matrices
+ * @param tile Rows and columns to process
+ */
+void LabelingNetworkSet::computeSweepTile(const LayerDistanceJob &job, const DistanceTile &tile) const
+{
+    const int numGaps = job.sweepGapPenalties.size();
+    if(!numGaps)
+        return;
+
+    const std::vector<MIDView> &mids = job.store->mids;
+    const std::vector<bool> &hasData = job.store->hasData;
+    const bool reuse = job.previousSweepDists.size();
+
+    std::vector<int> rowNodes;
+    std::vector<MIDView> rowMIDs;
+    std::vector<std::vector<double> > rowDists(numGaps);
+    std::vector<double *> rowDistPtrs(numGaps);
+
+    for(int n1 = tile.rowBegin; n1 < tile.rowEnd; ++n1) {
+        if(!hasData[n1])
+            continue;
+        const int o1 = reuse ? (*job.previousRows)[n1] : -1;
+
+        rowNodes.clear();
+        rowMIDs.clear();
+        for(int n2 = std::max(tile.colBegin, n1 + 1); n2 < tile.colEnd; ++n2) {
+            if(!hasData[n2])
+                continue;
+            // alignments are not symmetric, so swapped pairs are aligned again
+            int o2 = o1 >= 0 ? (*job.previousRows)[n2] : -1;
+            if(o1 >= 0 && o1 < o2) {
+                for(int g = 0; g < numGaps; ++g)
+                    (*job.sweepDists[g])[n1][n2] = (*job.previousSweepDists[g])[o1][o2];
+                continue;
+            }
+            rowNodes.push_back(n2);
+            rowMIDs.push_back(mids[n2]);
+        }
+
+        for(int g = 0; g < numGaps; ++g) {
+            rowDists[g].resize(rowMIDs.size());
+            rowDistPtrs[g] = rowDists[g].data();
+        }
+        job.distCalc->getMIDDistances(mids[n1], rowMIDs.data(), rowMIDs.size(), job.sweepGapPenalties.data(), numGaps, rowDistPtrs.data());
+
+        for(int g = 0; g < numGaps; ++g) {
+            std::vector<std::vector<double> > &mat = *job.sweepDists[g];
+            for(int r = 0; r < rowNodes.size(); ++r)
+                mat[n1][rowNodes[r]] = rowDists[g][r];
+        }
+    }
+}
+
+/**
+ * @brief Whether the layer's gap penalty sweep matrices are those of exactly the given gap penalties for @p numNodes nodes.
+ */
+bool LabelingNetworkSet::hasCurrentSweep(const std::string &experiment, const std::vector<double> &gapPenalties, int numNodes) const
+{
+    std::map<std::string, std::map<double, std::vector<std::vector<double> > > >::const_iterator it = sweepDistMats.find(experiment);
+    if(it == sweepDistMats.end() || it->second.size() != std::set<double>(gapPenalties.begin(), gapPenalties.end()).size())
+        return false;
+    for(int g = 0; g < gapPenalties.size(); ++g) {
+        std::map<double, std::vector<std::vector<double> > >::const_iterator mat = it->second.find(gapPenalties[g]);
+        if(mat == it->second.end() || mat->second.size() != numNodes)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Take the distance of an unchanged node pair from the previous matrix of the layer (see updateDistanceMatrices()) and
+ * add it to the tile's statistics. The status of the pair is carried over, so distances left infinite are counted as
+ * skipped, screened or abandoned as they were before.
+ * Only pairs in the same order as before are reused, distances of swapped pairs may differ.
+ * @return Whether the distance of the pair was known
+ */
+bool LabelingNetworkSet::reuseDistance(const LayerDistanceJob &job, int n1, int n2, DistanceTile &tile) const
+{
+    if(!job.previous)
+        return false;
+    int o1 = (*job.previousRows)[n1];
+    int o2 = (*job.previousRows)[n2];
+    // nodes with identical MIDs were never compared; alignments are not symmetric, so swapped pairs are aligned again
+    if(o1 < 0 || o2 < 0 || o1 >= o2)
+        return false;
+
+    double dist = (*job.previous)[o1][o2];
+    unsigned char status = (*job.previousStatus)[alignmentCacheIndex(o1, o2, job.previous->size())];
+    (*job.status)[alignmentCacheIndex(n1, n2, job.dists->size())] = status;
+    ++tile.reused;
+
+    switch(status) {
+    case DS_SKIPPED:
+        ++tile.skipped;
+        return true;
+    case DS_ABANDONED:
+        ++tile.abandoned;
+        return true;
+    case DS_SCREENED:
+        ++tile.screened;
+        return true;
+    }
+
+    (*job.dists)[n1][n2] = dist;
+
+    // stats
+    tile.sketch.add(dist);
+    tile.dMin = dist < tile.dMin ? dist : tile.dMin;
+    tile.dMax = dist > tile.dMax ? dist : tile.dMax;
+    tile.dSum += dist;
+    return true;
+}
+
+/**
+ * @brief Whether distances calculated with @p other settings are valid for these settings.
+ */
+bool LabelingNetworkSet::LayerMatrixInputs::hasSameSettings(const LayerMatrixInputs &other) const
+{
+    return config == other.config && ionPairMode == other.ionPairMode && distanceThreshold == other.distanceThreshold
+            && abandonThreshold == other.abandonThreshold && screeningThreshold == other.screeningThreshold;
+}
+
+/**
+ * @brief Everything the distances of a node depend on: its prepared MID and confidence intervals and, unless in IP_SELECTED_ION mode,
+ * those of all its labeled ions and their weights. Empty if the node has no data.
+ * @param store Prepared MIDs of a layer
+ * @param node Node index
+ * @param data Output
+ */
+void LabelingNetworkSet::getNodeData(const LayerMIDStore &store, int node, std::vector<double> &data) const
+{
+    data.clear();
+    if(!store.hasData[node])
+        return;
+
+    const MIDView &mid = store.mids[node];
+    data.push_back(mid.size);
+    data.insert(data.end(), mid.data, mid.data + mid.size);
+    data.insert(data.end(), mid.ci, mid.ci + mid.size);
+    if(ionPairMode == IP_SELECTED_ION)
+        return;
+    for(int i = store.ionBegin[node]; i < store.ionBegin[node + 1]; ++i) {
+        const MIDView &ion = store.ions[i];
+        data.push_back(ion.size);
+        data.insert(data.end(), ion.data, ion.data + ion.size);
+        data.insert(data.end(), ion.ci, ion.ci + ion.size);
+        data.push_back(store.ionWeights[i]);
+    }
+}
+
+/**
+ * @brief Distances of node @p n1 to the given nodes over all pairs of their labeled ions, according to the ion pair mode.
+ *
+ * Ion pairs are aligned in batches of one ion of @p n1 against ions of all nodes of the row
+ * (see MIDDistanceCalculator::getMIDDistances()). In IP_MIN mode, only the pair with the lowest distance lower bound
+ * (see MIDDistanceCalculator::getDistanceLowerBound()) is aligned first, then only those pairs whose lower bound is below
+ * the best distance found so far. In threshold mode, nodes whose aggregated lower bound exceeds the threshold are skipped,
+ * and with @p abandonThreshold, IP_MIN additionally skips pairs whose lower bound is above it; if no pair ends up below the
+ * threshold then, the distance is infinite.
+ *
+ * @param distCalc Distance calculator of the layer
+ * @param store Prepared MIDs of the layer including all ions
+ * @param n1 Row node
+ * @param rowNodes Nodes to compare @p n1 to; afterwards the nodes for which distances were calculated
+ * @param rowDists Output for the distances of @p rowNodes
+ * @param abandonThreshold Threshold for abandoning, negative to disable
+ * @param skippedNodes Output for the nodes skipped in threshold mode
+ * @param pairs Incremented by the number of ion pairs of all compared nodes
+ * @param alignments Incremented by the number of ion pairs actually aligned
+ */
+void LabelingNetworkSet::getIonPairDistances(const MIDDistanceCalculator &distCalc, const LayerMIDStore &store, int n1, std::vector<int> &rowNodes,
+                                             std::vector<double> &rowDists, double abandonThreshold, std::vector<int> &skippedNodes, int &pairs, int &alignments) const
+{
+    const double inf = std::numeric_limits<double>::infinity();
+    const int begin1 = store.ionBegin[n1];
+    const int numIons1 = store.ionBegin[n1 + 1] - begin1;
+    // the weighted mean needs lower bounds only for skipping nodes
+    const bool useBounds = ionPairMode == IP_MIN || distanceThreshold >= 0;
+
+    // all ion pairs of the row, by node
+    std::vector<int> nodes2;
+    std::vector<size_t> pairBegin(1, 0);
+    std::vector<int> pairIon1, pairIon2;
+    std::vector<double> pairBound, pairWeight;
+    for(int r = 0; r < rowNodes.size(); ++r) {
+        const int n2 = rowNodes[r];
+        const int begin2 = store.ionBegin[n2];
+        const int numIons2 = store.ionBegin[n2 + 1] - begin2;
+        if(!numIons1 || !numIons2)
+            continue;
+
+        const size_t first = pairBound.size();
+        double minBound = inf;
+        double weightSum = 0;
+        for(int i1 = begin1; i1 < begin1 + numIons1; ++i1) {
+            for(int i2 = begin2; i2 < begin2 + numIons2; ++i2) {
+                double bound = useBounds ? distCalc.getDistanceLowerBound(store.ionSums[i1], store.ionSums[i2]) : 0;
+                pairIon1.push_back(i1);
+                pairIon2.push_back(i2);
+                pairBound.push_back(bound);
+                pairWeight.push_back(store.ionWeights[i1] * store.ionWeights[i2]);
+                minBound = std::min(minBound, bound);
+                weightSum += pairWeight.back();
+            }
+        }
+        // no usable weights, use plain mean
+        if(!(weightSum > 0))
+            std::fill(pairWeight.begin() + first, pairWeight.end(), 1.0);
+
+        // threshold mode: skip nodes which can never be connected
+        double nodeBound = minBound;
+        if(ionPairMode == IP_WEIGHTED_MEAN) {
+            double boundSum = 0;
+            weightSum = 0;
+            for(size_t p = first; p < pairBound.size(); ++p) {
+                boundSum += pairWeight[p] * pairBound[p];
+                weightSum += pairWeight[p];
+            }
+            nodeBound = boundSum / weightSum;
+        }
+        if(distanceThreshold >= 0 && nodeBound > distanceThreshold) {
+            skippedNodes.push_back(n2);
+            pairIon1.resize(first);
+            pairIon2.resize(first);
+            pairBound.resize(first);
+            pairWeight.resize(first);
+            continue;
+        }
+
+        nodes2.push_back(n2);
+        pairBegin.push_back(pairBound.size());
+    }
+    pairs += pairBound.size();
+
+    std::vector<double> pairDist(pairBound.size(), inf);
+    std::vector<std::vector<size_t> > todo(numIons1); // pair indices to align, by ion of n1
+    std::vector<MIDView> batchMIDs;
+    std::vector<double> batchDists;
+
+    std::vector<bool> pruned(nodes2.size(), false);
+    for(int round = 0; round < 2; ++round) {
+        for(int k = 0; k < nodes2.size(); ++k) {
+            if(ionPairMode == IP_WEIGHTED_MEAN) {
+                if(round == 0) {
+                    for(size_t p = pairBegin[k]; p < pairBegin[k + 1]; ++p)
+                        todo[pairIon1[p] - begin1].push_back(p);
+                }
+                continue;
+            }
+
+            // IP_MIN: first the most promising pair, then all pairs which may still be better
+            size_t bestBound = pairBegin[k];
+            double best = inf;
+            for(size_t p = pairBegin[k]; p < pairBegin[k + 1]; ++p) {
+                if(pairBound[p] < pairBound[bestBound])
+                    bestBound = p;
+                best = std::min(best, pairDist[p]);
+            }
+            if(round == 0) {
+                todo[pairIon1[bestBound] - begin1].push_back(bestBound);
+                continue;
+            }
+            for(size_t p = pairBegin[k]; p < pairBegin[k + 1]; ++p) {
+                if(p == bestBound || !(pairBound[p] < best))
+                    continue;
+                if(abandonThreshold >= 0 && pairBound[p] > abandonThreshold) {
+                    pruned[k] = true;
+                    continue;
                 }
-                ++n2;
+                todo[pairIon1[p] - begin1].push_back(p);
             }
-            ++n1;
         }
-        double dMean = dSum / (dists.size() * (dists.size() - 1));
-        std::cout<<"Using "<<distCalc->distanceMeasure<<" / "<<distCalc->distanceNormalization<<std::endl;
-        std::cout<< "Distances ("<<dists.size()<<")\n\tRange: "<<dMin<<" - "<<dMax<<"\n\tMean: "<<dMean<<"\n";
 
-        distMats[t]= dists;
-        distRanges[t] = std::pair<double, double>(dMin, dMax);
+        // align scheduled pairs in batches
+        for(int i = 0; i < numIons1; ++i) {
+            if(!todo[i].size())
+                continue;
+            batchMIDs.clear();
+            for(int t = 0; t < todo[i].size(); ++t)
+                batchMIDs.push_back(store.ions[pairIon2[todo[i][t]]]);
+            batchDists.resize(batchMIDs.size());
+            distCalc.getMIDDistances(store.ions[begin1 + i], batchMIDs.data(), batchMIDs.size(), batchDists.data());
+            for(int t = 0; t < todo[i].size(); ++t)
+                pairDist[todo[i][t]] = batchDists[t];
+            alignments += todo[i].size();
+            todo[i].clear();
+        }
     }
 
-    std::cout<<"Done creating distance matrics..."<<std::endl;
+    rowNodes = nodes2;
+    rowDists.resize(nodes2.size());
+    for(int k = 0; k < nodes2.size(); ++k) {
+        if(ionPairMode == IP_WEIGHTED_MEAN) {
+            double distSum = 0;
+            double weightSum = 0;
+            for(size_t p = pairBegin[k]; p < pairBegin[k + 1]; ++p) {
+                distSum += pairWeight[p] * pairDist[p];
+                weightSum += pairWeight[p];
+            }
+            rowDists[k] = distSum / weightSum;
+        } else {
+            double best = *std::min_element(pairDist.begin() + pairBegin[k], pairDist.begin() + pairBegin[k + 1]);
+            // pairs above the threshold were not aligned, so this is not necessarily the minimum
+            rowDists[k] = (pruned[k] && best > abandonThreshold) ? inf : best;
+        }
+    }
+}
+
+/**
+ * @brief Discard prepared MIDs of all layers. Needed whenever nodes, their selected ions or M0 handling change.
+ */
+void LabelingNetworkSet::invalidateLayerMIDs()
+{
+    midStores.clear();
+}
+
+/**
+ * @brief Create the distance matrices of one layer for all given gap penalties, aligning each row of the
+ * upper triangle for all gap penalties in one go.
+ */
+void LabelingNetworkSet::createLayerDistanceMatrixSweep(const MIDDistanceCalculator &distCalc, const std::string &experiment, const std::vector<double> &gapPenalties,
+                                                        const std::vector<MIDView> &mids, const std::vector<bool> &hasData)
+{
+    std::map<double, std::vector<std::vector<double> > > &mats = sweepDistMats[experiment];
+    mats.clear();
+
+    const int numNodes = mids.size();
+    const int numGaps = gapPenalties.size();
+    std::vector<std::vector<std::vector<double> > *> dists(numGaps);
+    for(int g = 0; g < numGaps; ++g) {
+        dists[g] = &mats[gapPenalties[g]];
+        dists[g]->resize(numNodes);
+    }
+
+    std::vector<int> rowNodes;
+    std::vector<MIDView> rowMIDs;
+    std::vector<std::vector<double> > rowDists(numGaps);
+    std::vector<double *> rowDistPtrs(numGaps);
+    rowNodes.reserve(numNodes);
+    rowMIDs.reserve(numNodes);
+
+    for(int n1 = 0; n1 < numNodes; ++n1) {
+        for(int g = 0; g < numGaps; ++g) {
+            std::vector<double> &row = (*dists[g])[n1];
+            row.resize(numNodes);
+            row[n1] = 1; // diagonal
+            for(int n2 = n1 + 1; n2 < numNodes; ++n2) // do only upper half
+                row[n2] = std::numeric_limits<double>::infinity();
+        }
+
+        if(!hasData[n1])
+            continue;
+
+        rowNodes.clear();
+        rowMIDs.clear();
+        for(int n2 = n1 + 1; n2 < numNodes; ++n2) {
+            if(hasData[n2]) {
+                rowNodes.push_back(n2);
+                rowMIDs.push_back(mids[n2]);
+            }
+        }
+
+        for(int g = 0; g < numGaps; ++g) {
+            rowDists[g].resize(rowMIDs.size());
+            rowDistPtrs[g] = rowDists[g].data();
+        }
+        distCalc.getMIDDistances(mids[n1], rowMIDs.data(), rowMIDs.size(), gapPenalties.data(), numGaps, rowDistPtrs.data());
+
+        for(int g = 0; g < numGaps; ++g) {
+            std::vector<double> &row = (*dists[g])[n1];
+            for(int r = 0; r < rowNodes.size(); ++r)
+                row[rowNodes[r]] = rowDists[g][r];
+        }
+    }
+
+    std::cout<<"Created "<<mats.size()<<" distance matrices ("<<numNodes<<" nodes) for gap penalty sweep of "<<experiment<<std::endl;
 }
 
 void mia::LabelingNetworkSet::matchCompoundsAcrossExperiments(double mylibScoreCutoff, bool useLargestCommonIon)
@@ -438,6 +1859,7 @@ void LabelingNetworkSet::redetectAllIons()
         }
     }
 
+    invalidateLayerMIDs();
 }
 
 void LabelingNetworkSet::filterAndReIndexNodeCompounds()
@@ -467,6 +1889,8 @@ void LabelingNetworkSet::filterAndReIndexNodeCompounds()
         }
 
     }
+
+    invalidateLayerMIDs();
 }
 
 int LabelingNetworkSet::getNumberOfEdges(double variationCutoff, int excludeIfFoundInLessExperiments)
@@ -479,7 +1903,31 @@ int LabelingNetworkSet::getNumberOfEdges(double variationCutoff, int excludeIfFo
             continue;
 
         std::string t = datasets[ds]->getSettings().experiment;
-        std::vector<std::vector<double> > dists = distMats[t];
+
+        if(edgeMode == EM_NEAREST_NEIGHBORS) {
+            const NeighborGraph &graph = neighborGraphs[t];
+            for(int i = 0; i < graph.size(); ++i) {
+                if(excludeIfFoundInLessExperiments > 1 && nodes[i]->getExperiments().size() < excludeIfFoundInLessExperiments)
+                    continue;
+                if(datasets.size() > 1 && nodes[i]->getMaxIsotopomerSD() < variationCutoff)
+                    continue;
+
+                for(int k = 0; k < graph[i].size(); ++k) {
+                    int j = graph[i][k].first;
+                    if(j < i)
+                        continue;
+                    if(excludeIfFoundInLessExperiments > 1 && nodes[j]->getExperiments().size() < excludeIfFoundInLessExperiments)
+                        continue;
+                    if(datasets.size() > 1 && nodes[j]->getMaxIsotopomerSD() < variationCutoff)
+                        continue;
+                    ++e;
+                }
+            }
+            continue;
+        }
+
+        const DistanceMatrix &dists = distMats[t];
+        const std::vector<std::vector<int> > *closest = getClosestNodes(t);
         for(int i = 0; i < dists.size(); ++i) { // first node
 
             if(excludeIfFoundInLessExperiments > 1 && nodes[i]->getExperiments().size() < excludeIfFoundInLessExperiments)
@@ -492,7 +1940,7 @@ int LabelingNetworkSet::getNumberOfEdges(double variationCutoff, int excludeIfFo
                     continue;
                 if(datasets.size() > 1 && nodes[j]->getMaxIsotopomerSD() < variationCutoff)
                     continue;
-                if(dists[i][j] <= datasets[ds]->getSettings().mid_distance_cutoff)
+                if(dists[i][j] <= datasets[ds]->getSettings().mid_distance_cutoff && isEdgeKept(closest, i, j))
                     ++e;
             }
         }
@@ -611,7 +2059,37 @@ std::vector<LabelingDatasetEdge *> LabelingNetworkSet::getEdges(int excludeIfFou
             continue;
 
         std::string t = datasets[ds]->getSettings().experiment;
-        std::vector<std::vector<double> > dists = distMats[t];
+
+        if(edgeMode == EM_NEAREST_NEIGHBORS) {
+            const NeighborGraph &graph = neighborGraphs[t];
+            for(int i = 0; i < graph.size(); ++i) {
+                if(excludeIfFoundInLessExperiments > 1 && nodes[i]->getExperiments().size() < excludeIfFoundInLessExperiments)
+                    continue;
+                if(datasets.size() > 1 && nodes[i]->getMaxIsotopomerSD() < variationCutoff)
+                    continue;
+
+                for(int k = 0; k < graph[i].size(); ++k) {
+                    int j = graph[i][k].first;
+                    if(j < i)
+                        continue;
+                    if(excludeIfFoundInLessExperiments > 1 && nodes[j]->getExperiments().size() < excludeIfFoundInLessExperiments)
+                        continue;
+                    if(datasets.size() > 1 && nodes[j]->getMaxIsotopomerSD() < variationCutoff)
+                        continue;
+
+                    LabelingDatasetEdge *e = new LabelingDatasetEdge();
+                    e->datasetIndex = ds;
+                    e->node1 = nodes[i];
+                    e->node2 = nodes[j];
+                    e->distance = graph[i][k].second;
+                    edges.push_back(e);
+                }
+            }
+            continue;
+        }
+
+        const DistanceMatrix &dists = distMats[t];
+        const std::vector<std::vector<int> > *closest = getClosestNodes(t);
 
         for(int i = 0; i < dists.size(); ++i) { // first node
 
@@ -635,6 +2113,9 @@ std::vector<LabelingDatasetEdge *> LabelingNetworkSet::getEdges(int excludeIfFou
                 if(std::isnan(dists[i][j]) || dists[i][j] > datasets[ds]->getSettings().mid_distance_cutoff)
                     continue;
 
+                if(!isEdgeKept(closest, i, j))
+                    continue;
+
                 LabelingDatasetEdge *e = new LabelingDatasetEdge();
                 e->datasetIndex = ds;
                 e->node1 = nodes[i];
@@ -680,13 +2161,25 @@ void LabelingNetworkSet::getMinMaxDistances(double &overallMin, double &overallM
     overallMin = std::numeric_limits<double>::max();
     overallMax = 0;
 
-    std::vector<std::vector<double> > minDistances(distMats[datasets[0]->getSettings().experiment]);
-    std::vector<std::vector<double> > maxDistances(distMats[datasets[0]->getSettings().experiment]);
-    for(int i = 0; i < minDistances.size(); ++i) {
-        minDistances[i] = std::vector<double>(minDistances.size(), std::numeric_limits<double>::max());
-        maxDistances[i] = std::vector<double>(minDistances.size(), 0);
+    if(edgeMode == EM_NEAREST_NEIGHBORS) {
+        for(int ds = 0; ds < datasets.size(); ++ds) {
+            if(!datasets[ds]->isVisible())
+                continue;
+            const NeighborGraph &graph = neighborGraphs[datasets[ds]->getSettings().experiment];
+            for(int i = 0; i < graph.size(); ++i) {
+                for(int k = 0; k < graph[i].size(); ++k) {
+                    overallMin = std::min(overallMin, graph[i][k].second);
+                    overallMax = std::max(overallMax, graph[i][k].second);
+                }
+            }
+        }
+        return;
     }
 
+    size_t numNodes = distMats[datasets[0]->getSettings().experiment].size();
+    DistanceMatrix minDistances(numNodes, std::vector<DistanceValue>(numNodes, std::numeric_limits<DistanceValue>::max()));
+    DistanceMatrix maxDistances(numNodes, std::vector<DistanceValue>(numNodes, 0));
+
     for(int ds = 0; ds < datasets.size(); ++ds) { // each experiment
 
         // Include this layer?
@@ -694,20 +2187,23 @@ void LabelingNetworkSet::getMinMaxDistances(double &overallMin, double &overallM
             continue;
 
         std::string t = datasets[ds]->getSettings().experiment;
-        std::vector<std::vector<double> > &dists = distMats[t];
+        const DistanceMatrix &dists = distMats[t];
+        const std::vector<std::vector<int> > *closest = getClosestNodes(t);
+        double cutoff = datasets[ds]->getSettings().mid_distance_cutoff;
 
         for(int i = 0; i < dists.size(); ++i) { // first node
+            const DistanceValue *row = dists[i].data();
 
             for(int j = i + 1; j < dists[i].size(); ++j) { // second node
 
-                if(std::isnan(dists[i][j]) || dists[i][j] > datasets[ds]->getSettings().mid_distance_cutoff)
+                if(std::isnan(row[j]) || row[j] > cutoff || !isEdgeKept(closest, i, j))
                     continue;
 
-                minDistances[i][j] = std::min(minDistances[i][j], dists[i][j]);
-                maxDistances[i][j] = std::max(maxDistances[i][j], dists[i][j]);
+                minDistances[i][j] = std::min(minDistances[i][j], row[j]);
+                maxDistances[i][j] = std::max(maxDistances[i][j], row[j]);
 
-                overallMin = std::min(overallMin, dists[i][j]);
-                overallMax = std::max(overallMax, dists[i][j]);
+                overallMin = std::min(overallMin, (double)row[j]);
+                overallMax = std::max(overallMax, (double)row[j]);
             }
         }
     }
@@ -719,12 +2215,17 @@ QMap<int, NodeCompound *> LabelingNetworkSet::getNodeCompounds() const
     return nodes;
 }
 
+/**
+ * @brief Choose the selected ion of all nodes. Only the distances of nodes whose selected ion changed need to be
+ * recalculated by updateDistanceMatrices().
+ */
 void LabelingNetworkSet::setUseLargestCommonIon(bool newUseCommonIon)
 {
     // Need to tell NodeCompounds
     foreach (NodeCompound* c, nodes.values()) {
         c->setUseLargestCommonIon(newUseCommonIon);
     }
+    invalidateLayerMIDs();
 }
 
 QList<NetworkLayer *> LabelingNetworkSet::getDatasets()
@@ -747,16 +2248,74 @@ int LabelingNetworkSet::getSize()
     return datasets.size();
 }
 
+/**
+ * @brief Remove a layer: its compounds are removed from the nodes, nodes left without data are removed and the distance
+ * matrices of the other layers are updated (see updateDistanceMatrices()). Compounds are not matched again.
+ */
 void LabelingNetworkSet::removeDataset(NetworkLayer *ds)
 {
+    std::string t = ds->getSettings().experiment;
+    foreach (NodeCompound *nc, nodes) {
+        if(nc->hasDataForExperiment(t))
+            nc->removeLabeledCompound(nc->getLabeledCompound(t));
+    }
+
+    alignmentCaches.erase(t);
+    delete distCalcs[t];
+    distCalcs.erase(t);
+    sweepDistMats.erase(t);
+    midStores.erase(t);
+    distMats.erase(t);
+    distMatInputs.erase(t);
+    neighborGraphs.erase(t);
+    closestNodes.erase(t);
+    distStats.erase(t);
+    distRanges.erase(t);
     datasets.removeOne(ds);
-    createDistanceMatrices();
+
+    filterAndReIndexNodeCompounds();
+    updateDistanceMatrices();
 }
 
 void LabelingNetworkSet::removeAllDatasets()
 {
     qDeleteAll(datasets);
     datasets.clear();
+    alignmentCaches.clear();
+    for(std::map<std::string, MIDDistanceCalculator *>::iterator it = distCalcs.begin(); it != distCalcs.end(); ++it) {
+        delete it->second;
+    }
+    distCalcs.clear();
+    sweepDistMats.clear();
+    midStores.clear();
+    distMatInputs.clear();
+    neighborGraphs.clear();
+    closestNodes.clear();
+    distStats.clear();
+}
+
+/**
+ * @brief Index of node pair (n1, n2), n1 < n2, in the row-major upper triangle of an alignment cache.
+ */
+size_t LabelingNetworkSet::alignmentCacheIndex(size_t n1, size_t n2, size_t numNodes)
+{
+    return n1 * numNodes - n1 * (n1 + 1) / 2 + (n2 - n1 - 1);
+}
+
+/**
+ * @brief Distance calculator for the given layer with the layer's gap penalty and alignment band and the current distance measure and normalization.
+ * Calculators are kept until the settings change.
+ */
+const MIDDistanceCalculator &LabelingNetworkSet::getDistanceCalculator(const Settings &settings)
+{
+    MIDDistanceCalculator::Config config = distanceConfig.withGapPenalty(settings.nw_gap_penalty)
+            .withBand(settings.nw_band_width, settings.nw_band_adaptive);
+    MIDDistanceCalculator *&distCalc = distCalcs[settings.experiment];
+    if(!distCalc || distCalc->getConfig() != config) {
+        delete distCalc;
+        distCalc = new MIDDistanceCalculator(config);
+    }
+    return *distCalc;
 }
 
 void LabelingNetworkSet::setDistanceCutoff(double cutoff)
@@ -784,30 +2343,278 @@ void LabelingNetworkSet::setRelativeDistanceCutoff(double cutoff)
     }
 }
 
+/**
+ * @brief Set the cutoff of each layer so that its closest @p percent of node pairs are connected. The cutoff is taken
+ * from the layer's distance distribution as collected while calculating the distance matrix (see DistanceSketch),
+ * without scanning the matrix, and unlike setRelativeDistanceCutoff() it does not depend on outlying distances.
+ * Pairs with infinite distance (skipped, abandoned or screened) count as farthest.
+ * Without distance matrices (nearest neighbor mode), the cutoff is set to the maximum distance.
+ * @param percent Percentage of node pairs, 0-100
+ */
+void LabelingNetworkSet::setPercentileDistanceCutoff(double percent)
+{
+    for(int ds = 0; ds < datasets.size(); ++ds) {
+        Settings s = datasets[ds]->getSettings();
+        double newCutoff = distRanges[s.experiment].second;
+        std::map<std::string, LayerDistanceStats>::const_iterator stats = distStats.find(s.experiment);
+        if(stats != distStats.end()) {
+            size_t connected = percent / 100.0 * stats->second.pairs;
+            if(connected == 0)
+                newCutoff = 0;
+            else if(connected <= stats->second.sketch.getCount())
+                newCutoff = stats->second.sketch.getValueAtRank(connected - 1);
+        }
+        std::cout<<"Set '"<<s.experiment<<"' cutoff to "<<newCutoff<<" percentile is "<<percent<<std::endl;
+
+        s.mid_distance_cutoff = newCutoff;
+
+        datasets[ds]->setSettings(s);
+    }
+}
+
+/**
+ * @brief Set M0 handling for distance calculation. Takes effect with the next createDistanceMatrices() or updateDistanceMatrices().
+ */
 void LabelingNetworkSet::setExcludeM0(int excludeM0)
 {
     if(this->excludeM0 != excludeM0) {
         this->excludeM0 = excludeM0;
+        invalidateLayerMIDs();
+        // all prepared MIDs change, so updateDistanceMatrices() must not update in place
+        distMatNodes.clear();
+    }
+}
+
+/**
+ * @brief Choose which ions of two compounds are compared by createDistanceMatrices. Gap penalty sweeps
+ * (see createDistanceMatrixSweep) always use the selected ion. Takes effect with the next createDistanceMatrices()
+ * or updateDistanceMatrices(), which recalculates layers calculated with another mode.
+ */
+void LabelingNetworkSet::setIonPairMode(ION_PAIR_MODE mode)
+{
+    ionPairMode = mode;
+}
+
+LabelingNetworkSet::ION_PAIR_MODE LabelingNetworkSet::getIonPairMode() const
+{
+    return ionPairMode;
+}
+
+/**
+ * @brief Set threshold mode for createDistanceMatrices: pairs whose distance can be shown to exceed @p threshold
+ * without aligning them (see MIDDistanceCalculator::getDistanceLowerBound) get infinite distance.
+ * Cutoffs above the threshold will then miss edges.
+ * @param threshold Distance threshold, negative to disable.
+ */
+void LabelingNetworkSet::setDistanceThreshold(double threshold)
+{
+    if(distanceThreshold != threshold) {
+        distanceThreshold = threshold;
+        createDistanceMatrices();
+    }
+}
+
+/**
+ * @brief Number of alignments skipped in threshold mode by the last createDistanceMatrices() run.
+ */
+int LabelingNetworkSet::getSkippedAlignmentCount() const
+{
+    return skippedAlignments;
+}
+
+/**
+ * @brief Number of alignments abandoned early in threshold mode by the last createDistanceMatrices() run.
+ */
+int LabelingNetworkSet::getAbandonedAlignmentCount() const
+{
+    return abandonedAlignments;
+}
+
+/**
+ * @brief Set screening for createDistanceMatrices: pairs whose alignment-free distance (see MIDDistanceCalculator::getEMDDistance)
+ * exceeds @p threshold are not aligned and get infinite distance. Unlike setDistanceThreshold, this is a heuristic:
+ * the EMD is no lower bound for the other distance measures, so some pairs below the distance cutoff may be lost.
+ * In ion pair modes, the selected ions are used for screening.
+ * @param threshold Screening threshold, negative to disable.
+ */
+void LabelingNetworkSet::setScreeningThreshold(double threshold)
+{
+    if(screeningThreshold != threshold) {
+        screeningThreshold = threshold;
         createDistanceMatrices();
     }
 }
 
-double LabelingNetworkSet::getDistance(std::vector<double> mid1, std::vector<double> mid2, int excludeM0)
+/**
+ * @brief Number of pairs screened out by the last createDistanceMatrices() run, see setScreeningThreshold().
+ */
+int LabelingNetworkSet::getScreenedAlignmentCount() const
 {
+    return screenedAlignments;
+}
+
+/**
+ * @brief Set the number of threads for createDistanceMatrices().
+ * @param threads Number of threads, 0 for one per core
+ */
+void LabelingNetworkSet::setThreadCount(int threads)
+{
+    distancePool.setMaxThreadCount(threads > 0 ? threads : QThread::idealThreadCount());
+}
+
+int LabelingNetworkSet::getThreadCount() const
+{
+    return distancePool.maxThreadCount();
+}
+
+/**
+ * @brief Choose how nodes are connected. Takes effect with the next createDistanceMatrices() or updateDistanceMatrices().
+ * Nearest neighbor mode needs no distance matrices and thus scales to many more compounds; distance cutoffs do not apply
+ * there, see createNearestNeighborGraphs().
+ */
+void LabelingNetworkSet::setEdgeMode(EDGE_MODE mode)
+{
+    edgeMode = mode;
+}
+
+LabelingNetworkSet::EDGE_MODE LabelingNetworkSet::getEdgeMode() const
+{
+    return edgeMode;
+}
+
+/**
+ * @brief Set the number of neighbors per node in nearest neighbor mode (see setEdgeMode()). Takes effect with the next
+ * createDistanceMatrices() or updateDistanceMatrices().
+ */
+void LabelingNetworkSet::setNearestNeighborCount(int k)
+{
+    nearestNeighborCount = k;
+}
+
+int LabelingNetworkSet::getNearestNeighborCount() const
+{
+    return nearestNeighborCount;
+}
+
+/**
+ * @brief Threshold mode: only keep edges to the @p k closest nodes of each node per layer, so graphs have at most
+ * n k edges however dense the distances are. An edge is kept if either node is among the other's closest nodes.
+ * Takes effect with the next createDistanceMatrices() or updateDistanceMatrices(), which find the closest nodes
+ * without recalculating unchanged distances.
+ * @param k Edges per node, 0 for no limit
+ */
+void LabelingNetworkSet::setMaxEdgesPerNode(int k)
+{
+    maxEdgesPerNode = k;
+}
+
+int LabelingNetworkSet::getMaxEdgesPerNode() const
+{
+    return maxEdgesPerNode;
+}
+
+/**
+ * @brief Set distance measure for all layers, recalculates distances if changed.
+ */
+void LabelingNetworkSet::setDistanceMeasure(MIDDistanceCalculator::DISTANCE_MEASURE distanceMeasure)
+{
+    if(distanceConfig.getDistanceMeasure() != distanceMeasure) {
+        distanceConfig = distanceConfig.withDistanceMeasure(distanceMeasure);
+        createDistanceMatrices();
+    }
+}
+
+/**
+ * @brief Set distance normalization for all layers, recalculates distances if changed.
+ */
+void LabelingNetworkSet::setDistanceNormalization(MIDDistanceCalculator::DISTANCE_NORMALIZATION distanceNormalization)
+{
+    if(distanceConfig.getDistanceNormalization() != distanceNormalization) {
+        distanceConfig = distanceConfig.withDistanceNormalization(distanceNormalization);
+        createDistanceMatrices();
+    }
+}
+
+/**
+ * @brief Current distance measure and normalization. The gap penalty is the default one, layers use their own.
+ */
+MIDDistanceCalculator::Config LabelingNetworkSet::getDistanceConfig() const
+{
+    return distanceConfig;
+}
+
+double LabelingNetworkSet::getDistance(const MIDView &mid1, const MIDView &mid2, int excludeM0)
+{
+    MIDDistanceCalculator distCalc(distanceConfig);
+    // only normalizing modes need storage
+    std::vector<double> buffer(excludeM0 >= 2 ? mid1.size + mid2.size : 0);
+    return distCalc.getMIDDistance(prepareMID(mid1, excludeM0, buffer.data()), prepareMID(mid2, excludeM0, buffer.data() + mid1.size));
+    //dist = distCalc->getMIDDistance(basePeakNormalization(mid1), basePeakNormalization(mid2));
+}
+
+/**
+ * @brief Get MID as used for distance calculation, depending on M0 handling.
+ * @param mid
+ * @param excludeM0 0: use MID as is; 1: exclude M0; 2: exclude M0 and normalize to base peak; 3: exclude M0 and normalize to sum
+ * @return
+ */
+std::vector<double> LabelingNetworkSet::prepareMID(const std::vector<double> &mid, int excludeM0)
+{
+    std::vector<double> buffer(mid.size());
+    MIDView prepared = prepareMID(mid, excludeM0, buffer.data());
+    return std::vector<double>(prepared.data, prepared.data + prepared.size);
+}
+
+/**
+ * @brief Get view on MID as used for distance calculation, depending on M0 handling, without copying.
+ * @param mid
+ * @param excludeM0 0: use MID as is; 1: exclude M0; 2: exclude M0 and normalize to base peak; 3: exclude M0 and normalize to sum
+ * @param buffer Storage for mid.size - 1 normalized abundances in modes 2 and 3, may be mid.data to normalize in place
+ * @return View on @p mid (modes 0, 1) or @p buffer (modes 2, 3)
+ */
+MIDView LabelingNetworkSet::prepareMID(const MIDView &mid, int excludeM0, double *buffer)
+{
+    if(!mid.size)
+        return mid;
+
     switch(excludeM0) {
     case 1:
-        return distCalc->getMIDDistance(std::vector<double>(&(mid1[1]), &(mid1[mid1.size()])),
-                std::vector<double>(&(mid2[1]), &(mid2[mid2.size()])));
+        return MIDView(mid.data + 1, mid.size - 1);
     case 2:
-        return distCalc->getMIDDistance(basePeakNormalization(std::vector<double>(&(mid1[1]), &(mid1[mid1.size()]))),
-                basePeakNormalization(std::vector<double>(&(mid2[1]), &(mid2[mid2.size()]))));
+        basePeakNormalization(mid.data + 1, mid.size - 1, buffer);
+        return MIDView(buffer, mid.size - 1);
     case 3:
-        return distCalc->getMIDDistance(sumNormalization(std::vector<double>(&(mid1[1]), &(mid1[mid1.size()]))),
-                sumNormalization(std::vector<double>(&(mid2[1]), &(mid2[mid2.size()]))));
+        sumNormalization(mid.data + 1, mid.size - 1, buffer);
+        return MIDView(buffer, mid.size - 1);
     default:
-        return distCalc->getMIDDistance(mid1, mid2);
-        //dist = distCalc->getMIDDistance(basePeakNormalization(mid1), basePeakNormalization(mid2));
+        return mid;
     }
 }
 
+/**
+ * @brief Get view on confidence intervals of a MID as used for distance calculation, scaled like the MID by prepareMID().
+ * @param mid The MID (not prepared)
+ * @param ci Confidence intervals of @p mid
+ * @param excludeM0 0: use MID as is; 1: exclude M0; 2: exclude M0 and normalize to base peak; 3: exclude M0 and normalize to sum
+ * @param buffer Storage for mid.size - 1 scaled intervals in modes 2 and 3, may be ci.data to scale in place
+ * @return View on @p ci (modes 0, 1) or @p buffer (modes 2, 3)
+ */
+MIDView LabelingNetworkSet::prepareCI(const MIDView &mid, const MIDView &ci, int excludeM0, double *buffer)
+{
+    if(!mid.size || excludeM0 < 1 || excludeM0 > 3)
+        return ci;
+
+    if(excludeM0 == 1)
+        return MIDView(ci.data + 1, ci.size - 1);
+
+    // same divisor as basePeakNormalization / sumNormalization
+    double divisor = (excludeM0 == 2 && mid.size > 1) ? mid[1] : 0;
+    for(int i = 1; i < mid.size; ++i)
+        divisor = excludeM0 == 2 ? std::max(divisor, mid[i]) : divisor + mid[i];
+
+    for(int i = 1; i < mid.size; ++i)
+        buffer[i - 1] = ci[i] / divisor;
+    return MIDView(buffer, mid.size - 1);
+}
+
 }
@@ -21,15 +21,25 @@
 #define LABELINGNETWORKSET_H
 
 #include <QObject>
+#include <QAtomicInt>
 #include <QTextStream>
+#include <QThreadPool>
 #include <map>
 
 #include "nodecompound.h"
 #include "networklayer.h"
 #include "middistancecalculator.h"
+#include "distancesketch.h"
 
 namespace mia {
 
+#ifdef MIA_WITH_FLOAT_DISTANCES
+typedef float DistanceValue; /**< Type of stored distances, computation is done in double precision */
+#else
+typedef double DistanceValue; /**< Type of stored distances, computation is done in double precision */
+#endif
+typedef std::vector<std::vector<DistanceValue> > DistanceMatrix; /**< Row-wise distance matrix of a layer, only the upper triangle is used */
+
 class LabelingDatasetEdge {
 public:
     int datasetIndex;
@@ -53,6 +63,19 @@ public:
     // setActive(tracer);
     // getGraph() // as dot?
 
+    /** Which ions of two compounds to compare, see setIonPairMode() */
+    enum ION_PAIR_MODE {
+        IP_SELECTED_ION,    /** Only the selected ion of each compound (see NodeCompound::getSelectedIndex) */
+        IP_MIN,             /** Minimum distance over all pairs of labeled ions */
+        IP_WEIGHTED_MEAN    /** Mean distance over all pairs of labeled ions, weighted by the R2 of both MIDs */
+    };
+
+    /** Which node pairs of a layer are connected, see setEdgeMode() */
+    enum EDGE_MODE {
+        EM_THRESHOLD,           /** All pairs within the distance cutoff, based on full distance matrices */
+        EM_NEAREST_NEIGHBORS    /** Each node and its k nearest nodes, found without full distance matrices (see setNearestNeighborCount) */
+    };
+
     LabelingNetworkSet();
     ~LabelingNetworkSet();
 
@@ -62,7 +85,13 @@ public:
 
     bool nodeHasEdges(int n);
 
-    void createDistanceMatrices(); /** Setup the distance matrices */
+    void createDistanceMatrices(bool earlyAbandon = true); /** Setup the distance matrices */
+
+    void updateDistanceMatrices(); /** Update the distance matrices after layers, nodes or selected ions changed, reusing distances of unchanged nodes */
+
+    void createDistanceMatrixSweep(const std::vector<double> &gapPenalties);
+
+    std::map<double, std::vector<std::vector<double> > > getDistanceMatrixSweep(const std::string &experiment) const;
 
     void matchCompoundsAcrossExperiments(double mylibScoreCutoff, bool useLargestCommonIon);
 
@@ -100,23 +129,225 @@ public:
 
     void setDistanceCutoff(double cutoff);
     void setRelativeDistanceCutoff(double cutoff);
+    void setPercentileDistanceCutoff(double percent);
 
     void setExcludeM0(int excludeM0);
 
-    double getDistance(std::vector<double> mid1, std::vector<double> mid2, int excludeM0);
-
-    static MIDDistanceCalculator *distCalc;
+    void setIonPairMode(ION_PAIR_MODE mode);
+    ION_PAIR_MODE getIonPairMode() const;
+
+    void setDistanceThreshold(double threshold);
+    int getSkippedAlignmentCount() const;
+    int getAbandonedAlignmentCount() const;
+    void setScreeningThreshold(double threshold);
+    int getScreenedAlignmentCount() const;
+    void setThreadCount(int threads);
+    int getThreadCount() const;
+    void setEdgeMode(EDGE_MODE mode);
+    EDGE_MODE getEdgeMode() const;
+    void setNearestNeighborCount(int k);
+    int getNearestNeighborCount() const;
+    void setMaxEdgesPerNode(int k);
+    int getMaxEdgesPerNode() const;
+
+    void setDistanceMeasure(MIDDistanceCalculator::DISTANCE_MEASURE distanceMeasure);
+    void setDistanceNormalization(MIDDistanceCalculator::DISTANCE_NORMALIZATION distanceNormalization);
+    MIDDistanceCalculator::Config getDistanceConfig() const;
+
+    double getDistance(const MIDView &mid1, const MIDView &mid2, int excludeM0);
+    static std::vector<double> prepareMID(const std::vector<double> &mid, int excludeM0);
+    static MIDView prepareMID(const MIDView &mid, int excludeM0, double *buffer);
+    static MIDView prepareCI(const MIDView &mid, const MIDView &ci, int excludeM0, double *buffer);
 
 signals:
+    void layerDistancesReady(int datasetIndex); /** Emitted by createDistanceMatrices() as soon as the distance matrix of a layer is complete */
 
 public slots:
 
 private:
-    std::map<std::string, std::vector<std::vector<double> > > distMats; /** Distance matrices */
+    /**
+     * @brief Alignment paths of a layer's node pairs. Only valid for the stored gap penalty, nodes and MIDs; the MIDs
+     * as used for distance calculation reflect selected ion and M0 handling.
+     */
+    struct AlignmentCache {
+        AlignmentCache() : gapPenalty(-1) {}
+        double gapPenalty; /** Gap penalty the paths were computed with */
+        QList<int> nodeIds; /** Node IDs in matrix order */
+        std::vector<std::vector<double> > mids; /** MIDs the paths were computed for, by node */
+        std::vector<AlignmentPath> paths; /** Paths of the upper triangle, row-major, see alignmentCacheIndex() */
+    };
+
+    static size_t alignmentCacheIndex(size_t n1, size_t n2, size_t numNodes);
+
+    /** How the distance of a node pair was determined, infinite unless DS_CALCULATED */
+    enum DISTANCE_STATUS {
+        DS_NO_DATA,     /** At least one node has no data in the layer */
+        DS_CALCULATED,  /** Distance calculated */
+        DS_SKIPPED,     /** Skipped in threshold mode, the lower bound exceeds the threshold */
+        DS_ABANDONED,   /** Alignment abandoned early, the distance exceeds the threshold */
+        DS_SCREENED     /** Screened out, the earth mover's distance exceeds the screening threshold */
+    };
+
+    /**
+     * @brief Selected MIDs of a layer's nodes exactly as used for distance calculation (M0 handling and normalization applied),
+     * stored back to back, each followed by its confidence intervals. Built once and kept until ion selection, nodes or M0 handling change.
+     */
+    struct LayerMIDStore {
+        LayerMIDStore() : valid(false), hasIons(false) {}
+        bool valid; /** Whether the store reflects the current nodes and settings */
+        bool hasIons; /** Whether the MIDs of all labeled ions are included (ions, ionBegin, ionWeights) */
+        std::vector<double> data; /** All prepared MIDs and confidence intervals, by node index */
+        std::vector<MIDView> mids; /** Views on data (MID and confidence intervals) by node index, empty if the node has no data in this layer */
+        std::vector<bool> hasData; /** Whether the node has a MID in this layer */
+        std::vector<MIDView> ions; /** Views on data for all labeled ions of all nodes, prepared like mids */
+        std::vector<int> ionBegin; /** Index of the first ion of each node in ions, one more entry than nodes */
+        std::vector<double> ionWeights; /** Weight of each ion for IP_WEIGHTED_MEAN */
+        std::vector<MIDSums> ionSums; /** Sums of each ion's MID for distance lower bounds */
+    };
+
+    const LayerMIDStore &getLayerMIDs(const std::string &experiment);
+    void invalidateLayerMIDs();
+
+    const MIDDistanceCalculator &getDistanceCalculator(const Settings &settings);
+
+    /**
+     * @brief Inputs and output of a layer's distance matrix calculation, shared by all its tiles.
+     */
+    struct LayerDistanceJob {
+        const MIDDistanceCalculator *distCalc; /** Distance calculator of the layer */
+        const LayerMIDStore *store; /** Prepared MIDs of the layer */
+        AlignmentCache *cache; /** Alignment paths of the layer, updated for newly aligned pairs, or 0 if not cached (see useAlignmentCache()) */
+        const std::vector<bool> *cached; /** Whether the cached paths of a node are valid, by node index */
+        DistanceMatrix *dists; /** Output distance matrix */
+        double abandonThreshold; /** Threshold for early abandoning, negative to disable */
+        const DistanceMatrix *previous; /** Previous distance matrix of the layer to take unchanged distances from, or 0 */
+        const std::vector<int> *previousRows; /** Row of each node in previous, -1 if the node is new or its MIDs changed */
+        std::vector<unsigned char> *status; /** Output DISTANCE_STATUS of each node pair, upper triangle as in alignmentCacheIndex() */
+        const std::vector<unsigned char> *previousStatus; /** DISTANCE_STATUS of the pairs of previous, or 0 */
+        std::vector<double> sweepGapPenalties; /** Additional gap penalties to calculate distances for, see Settings::nw_gap_penalty_sweep */
+        std::vector<std::vector<std::vector<double> > *> sweepDists; /** Output matrices for sweepGapPenalties */
+        std::vector<const std::vector<std::vector<double> > *> previousSweepDists; /** Previous matrices for sweepGapPenalties matching previousRows, or empty */
+    };
+
+    /**
+     * @brief Everything a layer's distance matrix was calculated from, to decide which distances updateDistanceMatrices() can keep.
+     */
+    struct LayerMatrixInputs {
+        MIDDistanceCalculator::Config config; /** Distance calculator configuration */
+        ION_PAIR_MODE ionPairMode; /** Ion pair mode */
+        double distanceThreshold; /** Threshold mode threshold */
+        double abandonThreshold; /** Early abandoning threshold */
+        double screeningThreshold; /** Screening threshold */
+        std::vector<std::vector<double> > nodeData; /** Prepared MIDs of each node, see getNodeData() */
+
+        bool hasSameSettings(const LayerMatrixInputs &other) const;
+    };
+
+    void getNodeData(const LayerMIDStore &store, int node, std::vector<double> &data) const;
+
+    /**
+     * @brief Block of rows and columns of a layer's distance matrix, processed as one task, and its statistics.
+     */
+    struct DistanceTile {
+        DistanceTile(int rowBegin, int rowEnd, int colBegin, int colEnd);
+        int rowBegin, rowEnd; /** Rows [rowBegin, rowEnd) */
+        int colBegin, colEnd; /** Columns [colBegin, colEnd), only cells right of the diagonal are calculated */
+        double dMin, dMax, dSum; /** Distance statistics */
+        int skipped, abandoned, screened, cacheHits, ionPairs, ionPairAlignments, reused; /** Counts as logged by createDistanceMatrices() */
+        DistanceSketch sketch; /** Distances of the tile */
+    };
+
+    /**
+     * @brief Distribution of a layer's distances for percentile cutoffs, see setPercentileDistanceCutoff().
+     */
+    struct LayerDistanceStats {
+        LayerDistanceStats() : pairs(0), skipped(0), abandoned(0), screened(0) {}
+        DistanceSketch sketch; /** Finite distances of the layer's distance matrix */
+        size_t pairs; /** Node pairs with data in the layer, including those with infinite distance */
+        std::vector<unsigned char> status; /** DISTANCE_STATUS of each node pair, upper triangle as in alignmentCacheIndex() */
+        int skipped, abandoned, screened; /** Number of pairs with the respective status */
+    };
+
+    /**
+     * @brief A layer's distance matrix under construction by createDistanceMatrices(), see prepareLayerBuild().
+     */
+    struct LayerBuild {
+        int datasetIndex; /** Index of the layer in datasets */
+        DistanceMatrix dists; /** Matrix being filled, moved to distMats by finishLayerBuild() */
+        std::vector<unsigned char> status; /** Status of the pairs of dists, moved to distStats by finishLayerBuild() */
+        std::vector<bool> cached; /** Whether the cached paths of a node are valid, by node index */
+        std::vector<int> previousRows; /** Row of each node in the previous matrix, see LayerDistanceJob */
+        std::map<double, std::vector<std::vector<double> > > previousSweep; /** Previous gap penalty sweep, see LayerDistanceJob */
+        LayerMatrixInputs inputs; /** Inputs of the new matrix */
+        LayerDistanceJob job; /** Inputs and output of all tiles */
+        std::vector<DistanceTile> tiles; /** Tiles of the upper triangle */
+        QAtomicInt pendingTiles; /** Number of tiles not yet calculated */
+        bool inPlace; /** Only rows and columns of changed nodes are recalculated, directly in distMats, see prepareNodeUpdate() */
+        int changedNodes; /** Number of changed nodes if inPlace */
+        bool rangeMayShrink; /** Whether replaced distances may have defined the distance range if inPlace */
+    };
+
+    class DistanceTileTask;
+    class LayerBuildQueue;
+
+    static const int distanceTileSize = 64; /** Nodes per tile side, so a tile's MIDs stay in cache */
+    static const int alignmentCacheMaxNodes = 4096; /** Larger layers get no alignment cache, see useAlignmentCache() */
+
+    void buildDistanceMatrices(bool earlyAbandon, bool reuseDistances, const std::vector<int> *changedNodes);
+    LayerBuild *prepareLayerBuild(int datasetIndex, bool earlyAbandon, bool reuseDistances);
+    LayerBuild *prepareNodeUpdate(int datasetIndex, const std::vector<int> &changedNodes);
+    bool useAlignmentCache() const;
+    AlignmentCache *prepareAlignmentCache(int datasetIndex, const LayerMIDStore &store, const DistanceMatrix *previous,
+                                          const std::vector<int> &previousRows, std::vector<bool> &cached);
+    LayerMatrixInputs getMatrixSettings(const MIDDistanceCalculator &distCalc, bool earlyAbandon) const;
+    std::pair<double, double> getDistanceRange(const DistanceMatrix &dists, const std::vector<bool> &hasData, const LayerDistanceStats &stats) const;
+    void computeDistanceTile(const LayerDistanceJob &job, DistanceTile &tile) const;
+    void computeSweepTile(const LayerDistanceJob &job, const DistanceTile &tile) const;
+    bool hasCurrentSweep(const std::string &experiment, const std::vector<double> &gapPenalties, int numNodes) const;
+    bool reuseDistance(const LayerDistanceJob &job, int n1, int n2, DistanceTile &tile) const;
+    void finishLayerBuild(LayerBuild &build);
+
+    /** Neighbors of each node in a layer: node index and distance, by node index */
+    typedef std::vector<std::vector<std::pair<int, double> > > NeighborGraph;
+
+    void createNearestNeighborGraphs();
+
+    void findClosestNodes(const std::string &experiment);
+    const std::vector<std::vector<int> > *getClosestNodes(const std::string &experiment) const;
+    static bool isEdgeKept(const std::vector<std::vector<int> > *closest, int n1, int n2);
+
+    void getIonPairDistances(const MIDDistanceCalculator &distCalc, const LayerMIDStore &store, int n1, std::vector<int> &rowNodes,
+                             std::vector<double> &rowDists, double abandonThreshold, std::vector<int> &skippedNodes, int &pairs, int &alignments) const;
+    static void appendPreparedMID(std::vector<double> &data, std::vector<double> mid, std::vector<double> ci, int excludeM0);
+
+    void createLayerDistanceMatrixSweep(const MIDDistanceCalculator &distCalc, const std::string &experiment, const std::vector<double> &gapPenalties,
+                                        const std::vector<MIDView> &mids, const std::vector<bool> &hasData);
+
+    std::map<std::string, DistanceMatrix> distMats; /** Distance matrices */
+    std::map<std::string, LayerMatrixInputs> distMatInputs; /** What the distance matrices were calculated from, see updateDistanceMatrices() */
+    QList<NodeCompound*> distMatNodes; /** Nodes the distance matrices were calculated for, in matrix order */
     QMap<int, NodeCompound*> nodes; /** All the different compounds found in any experiment, index is the ID-feature of the compound */
     QList<NetworkLayer*> datasets; /** The "raw" data from the different experiments */
     std::map<std::string, std::pair<double, double> > distRanges; /** Distance matrices (min, max) */
+    std::map<std::string, LayerDistanceStats> distStats; /** Distance distribution by layer, see setPercentileDistanceCutoff() */
+    std::map<std::string, NeighborGraph> neighborGraphs; /** Nearest neighbor mode: symmetric neighbor lists by layer instead of distMats */
+    EDGE_MODE edgeMode; /** Threshold or nearest neighbor edges */
+    int nearestNeighborCount; /** Nearest neighbor mode: k */
+    int maxEdgesPerNode; /** Threshold mode: only keep edges to each node's closest nodes, unlimited if 0 */
+    std::map<std::string, std::vector<std::vector<int> > > closestNodes; /** Threshold mode with edge limit: each node's closest nodes by layer, sorted, see findClosestNodes() */
     int excludeM0;
+    ION_PAIR_MODE ionPairMode; /** Which ions to compare for distance calculation */
+    MIDDistanceCalculator::Config distanceConfig; /** Distance measure and normalization for all layers; gap penalties are taken from the layer settings */
+    std::map<std::string, MIDDistanceCalculator *> distCalcs; /** Distance calculators by layer */
+    std::map<std::string, LayerMIDStore> midStores; /** Prepared MIDs by layer, see getLayerMIDs() */
+    double distanceThreshold; /** Threshold mode: skip alignments whose lower bound exceeds this distance, disabled if negative */
+    int skippedAlignments; /** Number of alignments skipped in threshold mode by the last createDistanceMatrices() */
+    int abandonedAlignments; /** Number of alignments abandoned early in threshold mode by the last createDistanceMatrices() */
+    double screeningThreshold; /** Skip alignments whose earth mover's distance exceeds this distance, disabled if negative */
+    int screenedAlignments; /** Number of alignments screened out by the last createDistanceMatrices() */
+    QThreadPool distancePool; /** Threads for createDistanceMatrices(), see setThreadCount() */
+    std::map<std::string, AlignmentCache> alignmentCaches; /** Alignment paths by layer, so changing the distance measure needs no new alignments */
+    std::map<std::string, std::map<double, std::vector<std::vector<double> > > > sweepDistMats; /** Distance matrices by layer and gap penalty, see createDistanceMatrixSweep() */
 };
 
 }
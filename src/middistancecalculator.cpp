@@ -19,99 +19,767 @@
 //
 
 #include <cstdlib>
+#include <algorithm>
+#include <limits>
 #include <iomanip>
 #include <assert.h>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <QtConcurrent>
+#include <QThreadStorage>
 
 #include "alg/ap.h"
 #include "alg/statistics.h"
 
 #include "src/misc.h"
 #include "middistancecalculator.h"
+#include "miaexception.h"
 
 namespace mia {
 
-// initialize distance measures
-MIDDistanceCalculator::DISTANCE_MEASURE MIDDistanceCalculator::distanceMeasure = MIDDistanceCalculator::D_EUCLIDEAN;
-MIDDistanceCalculator::DISTANCE_NORMALIZATION MIDDistanceCalculator::distanceNormalization = MIDDistanceCalculator::DN_SUM;
+const int MIDDistanceCalculator::batchSize;
+const int MIDDistanceCalculator::maxFixedLength;
+
+namespace {
+
+// Accumulators for the distance measures, fed with one pair of aligned abundances at a time.
+// Same arithmetic as the respective functions in misc.h.
+
+struct EuclideanMeasure {
+    EuclideanMeasure() : d(0) {}
+    static double term(double a, double b) { return (a - b) * (a - b); }
+    void add(double a, double b) { d += term(a, b); }
+    double result(int) const { return sqrt(d); }
+    double d;
+};
+
+struct CanberraMeasure {
+    CanberraMeasure() : d(0) {}
+    static double term(double a, double b) { return fabs(a - b) / (fabs(a) + fabs(b)); }
+    void add(double a, double b) { d += term(a, b); }
+    double result(int) const { return d; }
+    double d;
+};
+
+struct ManhattanMeasure {
+    ManhattanMeasure() : d(0) {}
+    static double term(double a, double b) { return fabs(a - b); }
+    void add(double a, double b) { d += term(a, b); }
+    double result(int) const { return d; }
+    double d;
+};
+
+struct CosineMeasure {
+    CosineMeasure() : dot(0) {}
+    void add(double a, double b) { dot += a * b; }
+    double result(int) const { return dot; }
+    double dot;
+};
+
+// Euclidean distance down-weighting wide confidence intervals as in getCIWeightedDistance
+struct CIWeightedMeasure {
+    CIWeightedMeasure() : d(0) {}
+    void add(double a, double b, double ca, double cb) {
+        double s = fabs(a) + fabs(b);
+        double c = ca + cb;
+        if(s + c > 0)
+            d += (a - b) * (a - b) * s / (s + c);
+    }
+    double result(int) const { return sqrt(d); }
+    double d;
+};
+
+// Feed one pair of aligned abundances and their confidence intervals to a measure; only CIWeightedMeasure uses the latter
+template<class Measure>
+inline void addAligned(Measure &m, double a, double b, double, double) { m.add(a, b); }
+
+inline void addAligned(CIWeightedMeasure &m, double a, double b, double ca, double cb) { m.add(a, b, ca, cb); }
+
+// Pearson-based distance as in getCustomDistance, from sums instead of a second pass
+struct CustomMeasure {
+    CustomMeasure() : sv(0), sw(0), svv(0), sww(0), svw(0) {}
+    void add(double a, double b) { sv += a; sw += b; svv += a * a; sww += b * b; svw += a * b; }
+    double result(int size) const {
+        double m_v = sv / size;
+        double m_w = sw / size;
+        double sd_v = sqrt(std::max(0.0, svv / size - m_v * m_v));
+        double sd_w = sqrt(std::max(0.0, sww / size - m_w * m_w));
+        double cov = svw / size - m_v * m_w;
+        return 1 - cov / (sd_v * sd_w);
+    }
+    double sv, sw, svv, sww, svw;
+};
+
+// Normalization policies: divisor for the distance of MIDs of the given lengths, see MIDDistanceCalculator::getNormalizationDivisor()
+
+struct OneNormalization {
+    static double divisor(size_t, size_t) { return 1; }
+};
 
-double MIDDistanceCalculator::gapPenalty = 0.3;
-std::map<std::pair<int, int>, std::pair<double, double> > MIDDistanceCalculator::MCModels;
+struct SumNormalization {
+    static double divisor(size_t size1, size_t size2) { return size1 + size2; }
+};
 
+struct ProdNormalization {
+    static double divisor(size_t size1, size_t size2) { return size1 * size2; }
+};
+
+struct MaxNormalization {
+    static double divisor(size_t size1, size_t size2) { return std::max(size1, size2); }
+};
+
+struct MinNormalization {
+    static double divisor(size_t size1, size_t size2) { return std::min(size1, size2); }
+};
+
+// Normalization divisor as in MIDDistanceCalculator::getNormalizationDivisor()
+template<class Normalization>
+inline double normalizationDivisor(int alignedSize, size_t origSize1, size_t origSize2)
+{
+    origSize1 = origSize1?alignedSize:origSize1;
+    origSize2 = origSize2?alignedSize:origSize2;
+
+    return Normalization::divisor(origSize1, origSize2);
+}
+
+// Read access to the traceback matrix of a single alignment
+struct NWTraceback {
+    NWTraceback(const NWWorkspace &ws, int cols) : mat(ws.tracebackMat.data()), cols(cols) {}
+    char operator()(int i, int j) const { return mat[i * cols + j]; }
+    const char *mat;
+    int cols;
+};
+
+// Read access to a stack-resident traceback matrix with compile-time row length
+template<int COLS>
+struct NWFixedTraceback {
+    NWFixedTraceback(const char *mat) : mat(mat) {}
+    char operator()(int i, int j) const { return mat[i * COLS + j]; }
+    const char *mat;
+};
+
+// Replays a stored path. Steps are returned in order, one per call, as expected by accumulateDistance.
+struct PathTraceback {
+    PathTraceback(const AlignmentPath &path) : path(path), pos(0) {}
+    char operator()(int, int) const { return path.get(pos++); }
+    const AlignmentPath &path;
+    mutable int pos;
+};
+
+// Records the steps read from another traceback accessor into a path
+template<class Traceback>
+struct RecordingTraceback {
+    RecordingTraceback(const Traceback &tb, AlignmentPath &path) : tb(tb), path(path), pos(0) { path.clear(); }
+    char operator()(int i, int j) const {
+        char op = tb(i, j);
+        path.set(pos++, op);
+        return op;
+    }
+    const Traceback &tb;
+    AlignmentPath &path;
+    mutable int pos;
+};
+
+// Read access to one lane of the traceback matrix of a batch alignment.
+// Lower nibble: sdown < sright, upper nibble: min(sdown, sright) <= sdiag
+struct NWBatchTraceback {
+    NWBatchTraceback(const NWWorkspace &ws, int cols, int lane) : mat(ws.batchTracebackMat.data()), cols(cols), lane(lane) {}
+    char operator()(int i, int j) const {
+        unsigned char t = mat[i * cols + j];
+        if(!((t >> (4 + lane)) & 1))
+            return '\\';
+        return ((t >> lane) & 1) ? '|' : '-';
+    }
+    const unsigned char *mat;
+    int cols;
+    int lane;
+};
+
+}
+
+/**
+ * @brief Create calculator with the given settings. The calculator does not change afterwards and may be shared by threads.
+ * @param config Gap penalty, distance measure and normalization
+ */
+MIDDistanceCalculator::MIDDistanceCalculator(const Config &config)
+    : config(config)
+{
+    selectDrivers();
+}
+
+/**
+ * @brief Create calculator with the given gap penalty and default distance measure and normalization.
+ * @param gapPenalty Penalty for gap insertion
+ */
 MIDDistanceCalculator::MIDDistanceCalculator(double gapPenalty)
+    : config(gapPenalty)
+{
+    selectDrivers();
+}
+
+const MIDDistanceCalculator::Config &MIDDistanceCalculator::getConfig() const
+{
+    return config;
+}
+
+/**
+ * @brief Select the all-pairs drivers instantiated for the configured distance measure and normalization, so they
+ * need not be looked up for every pair.
+ */
+void MIDDistanceCalculator::selectDrivers()
+{
+    switch(config.getDistanceMeasure()) {
+    case D_CANBERRA:
+        selectDrivers<CanberraMeasure>();
+        break;
+    case D_MANHATTAN:
+        selectDrivers<ManhattanMeasure>();
+        break;
+    case D_COSINE:
+        selectDrivers<CosineMeasure>();
+        break;
+    case D_CUSTOM:
+        selectDrivers<CustomMeasure>();
+        break;
+    case D_CI_WEIGHTED:
+        selectDrivers<CIWeightedMeasure>();
+        break;
+    case D_EMD: // no alignment, drivers are never called
+    case D_EUCLIDEAN:
+    default:
+        selectDrivers<EuclideanMeasure>();
+    }
+}
+
+/**
+ * @brief Select the drivers for @p Measure and the configured distance normalization.
+ */
+template<class Measure>
+void MIDDistanceCalculator::selectDrivers()
+{
+    switch(config.getDistanceNormalization()) {
+    case DN_ONE:
+        setDrivers<Measure, OneNormalization>();
+        break;
+    case DN_PROD:
+        setDrivers<Measure, ProdNormalization>();
+        break;
+    case DN_MAX:
+        setDrivers<Measure, MaxNormalization>();
+        break;
+    case DN_MIN:
+        setDrivers<Measure, MinNormalization>();
+        break;
+    case DN_SUM:
+    default:
+        setDrivers<Measure, SumNormalization>();
+    }
+}
+
+template<class Measure, class Normalization>
+void MIDDistanceCalculator::setDrivers()
+{
+    batchDriver = &MIDDistanceCalculator::getMIDDistancesBatch<Measure, Normalization>;
+    sweepDriver = &MIDDistanceCalculator::getMIDDistancesSweep<Measure, Normalization>;
+    pathDriver = &MIDDistanceCalculator::getMIDDistancePath<Measure, Normalization>;
+}
+
+/**
+ * @brief Align the given MIDs and calculate the normalized distance in a single walk along the traceback, without building the aligned MIDs.
+ * @param mid1 First MID
+ * @param mid2 Second MID
+ * @return Normalized distance according to the configured distance measure and normalization
+ */
+double MIDDistanceCalculator::getMIDDistance(const MIDView &mid1, const MIDView &mid2) const
+{
+    if(config.getDistanceMeasure() == D_EMD)
+        return getEMDDistance(mid1, mid2);
+
+    if(config.getGapModel() != GM_FREE_END_GAPS) {
+        NWWorkspace &ws = workspace();
+        fillNWMatrices(mid1, mid2, ws);
+        return scoreTraceback(mid1, mid2, NWTraceback(ws, mid2.size + 1), config);
+    }
+
+    int lo, hi;
+    if(getBand(mid1.size, mid2.size, lo, hi)) {
+        NWWorkspace &ws = workspace();
+        if(!fillNWMatricesBanded(mid1, mid2, config.getGapPenalty(), lo, hi, ws))
+            fillNWMatrices(mid1, mid2, config.getGapPenalty(), ws);
+        return scoreTraceback(mid1, mid2, NWTraceback(ws, mid2.size + 1), config);
+    }
+
+    return getKernel(mid1.size, mid2.size)(mid1, mid2, config);
+}
+
+/**
+ * @brief Like getMIDDistance(const MIDView &, const MIDView &), but stops the alignment as soon as the distance is
+ * known to exceed @p abandonThreshold.
+ *
+ * Along with the scores, each DP cell keeps the partial distance (sum of non-negative per-position terms) of the path
+ * leading to it. The final path crosses every row, so once the smallest partial distance of a row exceeds the threshold,
+ * normalized for the longest possible alignment, the final distance will as well. Only for distance measures
+ * where supportsEarlyAbandon() is true, others are aligned completely.
+ *
+ * @param mid1 First MID
+ * @param mid2 Second MID
+ * @param abandonThreshold Threshold for the normalized distance, negative to disable
+ * @param path Optional output for the alignment path, invalid if abandoned
+ * @return Normalized distance or infinity if the alignment was abandoned
+ */
+double MIDDistanceCalculator::getMIDDistance(const MIDView &mid1, const MIDView &mid2, double abandonThreshold, AlignmentPath *path) const
+{
+    if(config.getDistanceMeasure() == D_EMD) {
+        if(path)
+            path->clear();
+        return getEMDDistance(mid1, mid2);
+    }
+
+    if(abandonThreshold < 0 || !supportsEarlyAbandon() || !mid1.size || !mid2.size) {
+        if(!path)
+            return getMIDDistance(mid1, mid2);
+        abandonThreshold = -1;
+    }
+
+    // partial distances for the longest possible alignment; guard against rounding, must never abandon too early
+    double limit = abandonThreshold * getNormalizationDivisor(mid1.size + mid2.size, mid1.size, mid2.size, config) * (1 + 1e-9);
+    const double gapPenalty = config.getGapPenalty();
+
+    NWWorkspace &ws = workspace();
+    bool completed = true;
+    if(abandonThreshold < 0) {
+        fillNWMatrices(mid1, mid2, ws);
+    } else {
+        switch(config.getDistanceMeasure()) {
+        case D_EUCLIDEAN:
+            completed = fillNWMatricesAbandon<EuclideanMeasure>(mid1, mid2, gapPenalty, limit * limit, ws);
+            break;
+        case D_CANBERRA:
+            completed = fillNWMatricesAbandon<CanberraMeasure>(mid1, mid2, gapPenalty, limit, ws);
+            break;
+        case D_MANHATTAN:
+            completed = fillNWMatricesAbandon<ManhattanMeasure>(mid1, mid2, gapPenalty, limit, ws);
+            break;
+        default:
+            fillNWMatrices(mid1, mid2, ws);
+        }
+    }
+
+    if(!completed) {
+        if(path)
+            path->clear();
+        return std::numeric_limits<double>::infinity();
+    }
+
+    return scoreTraceback(mid1, mid2, NWTraceback(ws, mid2.size + 1), config, path);
+}
+
+/**
+ * @brief Distance of two MIDs from an alignment path recorded before, see getMIDDistances(). Much cheaper than aligning,
+ * so changing the distance measure or normalization does not require new alignments.
+ * @param mid1 First MID
+ * @param mid2 Second MID
+ * @param path Valid alignment path of exactly these MIDs; ignored for D_EMD, which does not align
+ * @return Normalized distance according to the configured distance measure and normalization
+ */
+double MIDDistanceCalculator::getMIDDistance(const MIDView &mid1, const MIDView &mid2, const AlignmentPath &path) const
+{
+    if(config.getDistanceMeasure() == D_EMD)
+        return getEMDDistance(mid1, mid2);
+
+    assert(path.isValid());
+    return pathDriver(mid1, mid2, path);
+}
+
+/**
+ * @brief getMIDDistance(const MIDView &, const MIDView &, const AlignmentPath &) for the given measure and normalization.
+ */
+template<class Measure, class Normalization>
+double MIDDistanceCalculator::getMIDDistancePath(const MIDView &mid1, const MIDView &mid2, const AlignmentPath &path)
+{
+    return accumulateDistance<Measure, Normalization>(mid1, mid2, PathTraceback(path));
+}
+
+/**
+ * @brief Whether the configured distance measure is a sum of non-negative per-position terms, which is required for early abandoning.
+ */
+bool MIDDistanceCalculator::supportsEarlyAbandon() const
 {
-     gapPenalty = gapPenalty;
+    DISTANCE_MEASURE d = config.getDistanceMeasure();
+    return (d == D_EUCLIDEAN || d == D_CANBERRA || d == D_MANHATTAN) && config.getGapModel() == GM_FREE_END_GAPS;
 }
 
-void MIDDistanceCalculator::setDistanceMeasure(MIDDistanceCalculator::DISTANCE_MEASURE d)
+/**
+ * @brief Diagonal band for banded alignment of MIDs of the given lengths, as range of j - i (column - row) of the DP matrix.
+ * A band of width w is [-w, w] or, if adaptive, [min(0, len2 - len1) - w, max(0, len2 - len1) + w].
+ * @param len1 Length of first MID
+ * @param len2 Length of second MID
+ * @param lo Output for the lowest diagonal in the band
+ * @param hi Output for the highest diagonal in the band
+ * @return false if no band is configured, the band does not contain the end of the alignment or covers the whole matrix,
+ * or both MIDs are short enough for the length-specialized kernels, which are faster than any band at these lengths
+ */
+bool MIDDistanceCalculator::getBand(int len1, int len2, int &lo, int &hi) const
+{
+    const int width = config.getBandWidth();
+    if(width <= 0 || !len1 || !len2 || (len1 <= maxFixedLength && len2 <= maxFixedLength))
+        return false;
+
+    const int d = len2 - len1;
+    if(config.isAdaptiveBand()) {
+        lo = std::min(0, d) - width;
+        hi = std::max(0, d) + width;
+    } else {
+        lo = -width;
+        hi = width;
+    }
+
+    if(d < lo || d > hi)
+        return false;
+
+    return lo > -len1 || hi < len2;
+}
+
+/**
+ * @brief Earth mover's distance of the given MIDs (see getEarthMoversDistance()), normalized like an alignment of the
+ * length of the longer MID. Takes linear time and needs no alignment, so it is suited to screen pairs before aligning
+ * them with another distance measure. Used by getMIDDistance() for D_EMD.
+ * @param mid1 First MID
+ * @param mid2 Second MID
+ * @return Normalized distance according to the configured distance normalization
+ */
+double MIDDistanceCalculator::getEMDDistance(const MIDView &mid1, const MIDView &mid2) const
 {
-    // doesnt make sense, is static
-    distanceMeasure = d;
+    double dist = getEarthMoversDistance(mid1.data, mid1.size, mid2.data, mid2.size);
+
+    return normalizeDistance(dist, std::max(mid1.size, mid2.size), mid1.size, mid2.size, config);
 }
 
-double MIDDistanceCalculator::getMIDDistance(std::vector<double> mid1, std::vector<double> mid2)
+/**
+ * @brief Same as getMIDDistance(const MIDView &, const MIDView &), additionally passing matrices and aligned MIDs to @p sink.
+ * Slower, as the aligned MIDs are built; meant for reports, not for distance matrices.
+ * @param mid1 First MID
+ * @param mid2 Second MID
+ * @param sink Receives the alignment; not called for D_EMD, which does not align
+ * @return Normalized distance according to the configured distance measure and normalization
+ */
+double MIDDistanceCalculator::traceMIDDistance(const MIDView &mid1, const MIDView &mid2, AlignmentTraceSink &sink) const
 {
-    return getMIDDistance(nw(mid1, mid2), mid1.size(), mid2.size());
+    if(config.getDistanceMeasure() == D_EMD)
+        return getEMDDistance(mid1, mid2);
+
+    NWWorkspace &ws = workspace();
+    fillNWMatrices(mid1, mid2, ws);
+    double dist = scoreTraceback(mid1, mid2, NWTraceback(ws, mid2.size + 1), config);
+    int alignedSize = traceback(mid1, mid2, ws);
+    sink.trace(mid1, mid2, ws, alignedSize, dist);
+
+    return dist;
 }
 
-double MIDDistanceCalculator::getMIDDistance(std::vector<double> mid1, std::vector<double> mid2, double gapPenalty)
+/**
+ * @brief getMIDDistance() for MIDs of any length, using the per-thread workspace.
+ */
+double MIDDistanceCalculator::getMIDDistanceWorkspace(const MIDView &mid1, const MIDView &mid2, const Config &config)
 {
-    return getMIDDistance(nw<double>(mid1, mid2, gapPenalty), mid1.size(), mid2.size());
+    NWWorkspace &ws = workspace();
+    fillNWMatrices(mid1, mid2, config.getGapPenalty(), ws);
+
+    return scoreTraceback(mid1, mid2, NWTraceback(ws, mid2.size + 1), config);
 }
 
-double MIDDistanceCalculator::getMIDDistance(std::pair<std::vector<double>, std::vector<double> > const &aligned, size_t origSize1, size_t origSize2)
+/**
+ * @brief Distances of one MID to many others. Aligns blocks of batchSize MIDs simultaneously (AVX/SSE2 lanes if available),
+ * results are the same as from getMIDDistance().
+ * @param mid1 MID to compare to all others
+ * @param mids2 Array of MIDs to compare to
+ * @param count Number of MIDs in @p mids2
+ * @param dists Output array for the @p count distances
+ * @param abandonThreshold If not negative, alignments are done pairwise and abandoned early once the distance is known to
+ * exceed this threshold (see getMIDDistance(const MIDView &, const MIDView &, double, AlignmentPath *)). Gap models other
+ * than GM_FREE_END_GAPS are always aligned pairwise. The band is not used here: banded alignments give the same distances,
+ * but even for MIDs beyond maxFixedLength the batch alignment is faster than aligning pairwise within the band.
+ * @param paths Optional output array for the @p count alignment paths, invalid for abandoned alignments and D_EMD
+ */
+void MIDDistanceCalculator::getMIDDistances(const MIDView &mid1, const MIDView *mids2, int count, double *dists, double abandonThreshold, AlignmentPath *paths) const
 {
-    const std::vector<double> &alV1 = aligned.first;
-    const std::vector<double> &alV2 = aligned.second;
+    if(config.getDistanceMeasure() == D_EMD) {
+        for(int k = 0; k < count; ++k) {
+            dists[k] = getEMDDistance(mid1, mids2[k]);
+            if(paths)
+                paths[k].clear();
+        }
+        return;
+    }
+
+    if((abandonThreshold >= 0 && supportsEarlyAbandon()) || config.getGapModel() != GM_FREE_END_GAPS) {
+        for(int k = 0; k < count; ++k) {
+            dists[k] = getMIDDistance(mid1, mids2[k], abandonThreshold, paths ? &paths[k] : 0);
+        }
+        return;
+    }
 
-    // printAlignedVectors(alV1, alV2);
+    (this->*batchDriver)(mid1, mids2, count, dists, paths);
+}
+
+/**
+ * @brief Batch alignment part of getMIDDistances(const MIDView &, const MIDView *, int, double *, double, AlignmentPath *),
+ * instantiated for each distance measure and normalization, see selectDrivers().
+ */
+template<class Measure, class Normalization>
+void MIDDistanceCalculator::getMIDDistancesBatch(const MIDView &mid1, const MIDView *mids2, int count, double *dists, AlignmentPath *paths) const
+{
+    NWWorkspace &ws = workspace();
+    double laneGaps[batchSize];
+    std::fill(laneGaps, laneGaps + batchSize, config.getGapPenalty());
+
+    for(int b = 0; b < count; b += batchSize) {
+        int curCount = std::min(batchSize, count - b);
+        fillNWMatricesBatch(mid1, &mids2[b], laneGaps, curCount, ws);
+
+        int cols = 1;
+        for(int k = 0; k < curCount; ++k)
+            cols = std::max(cols, mids2[b + k].size + 1);
+
+        if(paths) {
+            for(int k = 0; k < curCount; ++k) {
+                NWBatchTraceback tb(ws, cols, k);
+                dists[b + k] = accumulateDistance<Measure, Normalization>(mid1, mids2[b + k], RecordingTraceback<NWBatchTraceback>(tb, paths[b + k]));
+            }
+        } else {
+            for(int k = 0; k < curCount; ++k) {
+                dists[b + k] = accumulateDistance<Measure, Normalization>(mid1, mids2[b + k], NWBatchTraceback(ws, cols, k));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Distances of one MID to many others for several gap penalties in one go. Each (MID, gap penalty) combination
+ * occupies one lane of the batch alignment, so the MIDs are loaded and converted only once for all gap penalties.
+ * Results are the same as from getMIDDistance(const MIDView &, const MIDView &) of a calculator with the respective gap penalty;
+ * the configured gap penalty is not used.
+ * @param mid1 MID to compare to all others
+ * @param mids2 Array of MIDs to compare to
+ * @param count Number of MIDs in @p mids2
+ * @param gapPenalties Array of gap penalties
+ * @param numGapPenalties Number of gap penalties in @p gapPenalties
+ * @param dists Output arrays, one per gap penalty, for the @p count distances each
+ */
+void MIDDistanceCalculator::getMIDDistances(const MIDView &mid1, const MIDView *mids2, int count, const double *gapPenalties, int numGapPenalties, double **dists) const
+{
+    if(config.getDistanceMeasure() == D_EMD) { // independent of gap penalty
+        for(int k = 0; k < count; ++k) {
+            double dist = getEMDDistance(mid1, mids2[k]);
+            for(int g = 0; g < numGapPenalties; ++g)
+                dists[g][k] = dist;
+        }
+        return;
+    }
+
+    if(config.getGapModel() != GM_FREE_END_GAPS) { // not supported by the batch kernels
+        NWWorkspace &ws = workspace();
+        for(int k = 0; k < count; ++k) {
+            for(int g = 0; g < numGapPenalties; ++g) {
+                fillNWMatricesConsecutiveGapDiscount(mid1, mids2[k], gapPenalties[g], ws);
+                dists[g][k] = scoreTraceback(mid1, mids2[k], NWTraceback(ws, mids2[k].size + 1), config);
+            }
+        }
+        return;
+    }
+
+    sweepDriver(mid1, mids2, count, gapPenalties, numGapPenalties, dists);
+}
+
+/**
+ * @brief getMIDDistances(const MIDView &, const MIDView *, int, const double *, int, double **) for the given measure and normalization.
+ */
+template<class Measure, class Normalization>
+void MIDDistanceCalculator::getMIDDistancesSweep(const MIDView &mid1, const MIDView *mids2, int count, const double *gapPenalties, int numGapPenalties, double **dists)
+{
+    NWWorkspace &ws = workspace();
+    MIDView laneMIDs[batchSize];
+    double laneGaps[batchSize];
+    const int total = count * numGapPenalties;
 
+    for(int b = 0; b < total; b += batchSize) {
+        int curCount = std::min(batchSize, total - b);
+        int cols = 1;
+        for(int k = 0; k < curCount; ++k) {
+            laneMIDs[k] = mids2[(b + k) / numGapPenalties];
+            laneGaps[k] = gapPenalties[(b + k) % numGapPenalties];
+            cols = std::max(cols, laneMIDs[k].size + 1);
+        }
+
+        fillNWMatricesBatch(mid1, laneMIDs, laneGaps, curCount, ws);
+
+        for(int k = 0; k < curCount; ++k) {
+            dists[(b + k) % numGapPenalties][(b + k) / numGapPenalties] = accumulateDistance<Measure, Normalization>(mid1, laneMIDs[k], NWBatchTraceback(ws, cols, k));
+        }
+    }
+}
+
+/**
+ * @brief Normalized distance of already aligned MIDs, see getAlignedDistance().
+ */
+double MIDDistanceCalculator::getMIDDistance(std::pair<std::vector<double>, std::vector<double> > const &aligned, size_t origSize1, size_t origSize2) const
+{
+    assert(aligned.first.size() == aligned.second.size());
+    return getAlignedDistance(aligned.first.data(), aligned.second.data(), aligned.first.size(), origSize1, origSize2);
+}
+
+/**
+ * @brief Normalized distance of already aligned MIDs according to the configured distance measure and normalization.
+ * @param alV1 First aligned MID
+ * @param alV2 Second aligned MID
+ * @param alignedSize Length of the aligned MIDs
+ * @param origSize1 Length of first MID before alignment
+ * @param origSize2 Length of second MID before alignment
+ * @return Normalized distance
+ * @throws MIAException for D_CI_WEIGHTED, aligned MIDs carry no confidence intervals
+ */
+double MIDDistanceCalculator::getAlignedDistance(const double *alV1, const double *alV2, int alignedSize, size_t origSize1, size_t origSize2) const
+{
     double dist;
 
-    switch(distanceMeasure) {
+    switch(config.getDistanceMeasure()) {
     case D_EUCLIDEAN:
-        dist = getEuclideanDistance(alV1, alV2);
+        dist = getEuclideanDistance(alV1, alV2, alignedSize);
         break;
     case D_CANBERRA:
-        dist = getCanberraDistance(alV1, alV2);
+        dist = getCanberraDistance(alV1, alV2, alignedSize);
         break;
     case D_MANHATTAN:
-        dist = getManhattanDistance(alV1, alV2);
+        dist = getManhattanDistance(alV1, alV2, alignedSize);
         break;
     case D_COSINE:
-        dist = getCosineCorrelation(alV1, alV2);
+        dist = getCosineCorrelation(alV1, alV2, alignedSize);
         break;
     case D_CUSTOM:
-        dist = getCustomDistance(alV1, alV2);
+        dist = getCustomDistance(alV1, alV2, alignedSize);
+        break;
+    case D_CI_WEIGHTED:
+        throw MIAException("MIDDistanceCalculator::getAlignedDistance: no confidence intervals for aligned MIDs");
+    case D_EMD:
+        dist = getEarthMoversDistance(alV1, alignedSize, alV2, alignedSize);
         break;
     default:
-        dist = getEuclideanDistance(alV1, alV2);
+        dist = getEuclideanDistance(alV1, alV2, alignedSize);
     }
 
-    double divideBy = 1;
+    return normalizeDistance(dist, alignedSize, origSize1, origSize2, config);
+}
+
+/**
+ * @brief Normalize distance according to the distance normalization of @p config.
+ * @param dist Distance of the aligned MIDs
+ * @param alignedSize Length of the aligned MIDs
+ * @param origSize1 Length of first MID before alignment
+ * @param origSize2 Length of second MID before alignment
+ * @param config Distance settings
+ * @return Absolute normalized distance
+ */
+double MIDDistanceCalculator::normalizeDistance(double dist, int alignedSize, size_t origSize1, size_t origSize2, const Config &config)
+{
+    // log(alV2.size())
 
-    origSize1 = origSize1?alV1.size():origSize1;
-    origSize2 = origSize2?alV2.size():origSize2;
+    return fabs(dist / getNormalizationDivisor(alignedSize, origSize1, origSize2, config));
+}
 
-    switch(MIDDistanceCalculator::distanceNormalization) {
+/**
+ * @brief Divisor for normalization according to the distance normalization of @p config. Non-decreasing in @p alignedSize.
+ * @param alignedSize Length of the aligned MIDs
+ * @param origSize1 Length of first MID before alignment
+ * @param origSize2 Length of second MID before alignment
+ * @param config Distance settings
+ * @return
+ */
+double MIDDistanceCalculator::getNormalizationDivisor(int alignedSize, size_t origSize1, size_t origSize2, const Config &config)
+{
+    switch(config.getDistanceNormalization()) {
     case DN_MAX:
-        divideBy = std::max(origSize1, origSize2);
-        break;
+        return normalizationDivisor<MaxNormalization>(alignedSize, origSize1, origSize2);
     case DN_MIN:
-        divideBy = std::min(origSize1, origSize2);
-        break;
+        return normalizationDivisor<MinNormalization>(alignedSize, origSize1, origSize2);
     case DN_PROD:
-        divideBy = origSize1 * origSize2;
-        break;
+        return normalizationDivisor<ProdNormalization>(alignedSize, origSize1, origSize2);
     case DN_SUM:
-        divideBy = origSize1 + origSize2;
-        break;
+        return normalizationDivisor<SumNormalization>(alignedSize, origSize1, origSize2);
+    default:
+        return normalizationDivisor<OneNormalization>(alignedSize, origSize1, origSize2);
     }
+}
 
-    // log(alV2.size())
+/**
+ * @brief Lower bound for getMIDDistance() that holds for any alignment of the given MIDs, without aligning them.
+ *
+ * Alignment only inserts zeros, so sums and norms of the aligned MIDs equal those of the MIDs themselves and the aligned
+ * length is at most mid1.size + mid2.size. For the Euclidean distance |sum1 - sum2| / sqrt(L) (Cauchy-Schwarz) and
+ * | ||mid1|| - ||mid2|| | (triangle inequality) are lower bounds, for Manhattan additionally |sum1 - sum2| and the
+ * difference of the L1 norms. As the normalization divisor does not decrease with the aligned length, the bound is
+ * normalized for the longest possible alignment. For all other measures, 0 is returned.
+ *
+ * @param mid1 First MID
+ * @param mid2 Second MID
+ * @return Lower bound for the normalized distance
+ */
+double MIDDistanceCalculator::getDistanceLowerBound(const MIDView &mid1, const MIDView &mid2) const
+{
+    const DISTANCE_MEASURE distanceMeasure = config.getDistanceMeasure();
+
+    if(distanceMeasure != D_EUCLIDEAN && distanceMeasure != D_MANHATTAN)
+        return 0;
 
-    return fabs(dist / divideBy);
+    return getDistanceLowerBound(MIDSums(mid1), MIDSums(mid2));
+}
+
+/**
+ * @brief Same as getDistanceLowerBound(const MIDView &, const MIDView &), from precomputed sums.
+ * @param sums1 Sums of first MID
+ * @param sums2 Sums of second MID
+ * @return Lower bound for the normalized distance
+ */
+double MIDDistanceCalculator::getDistanceLowerBound(const MIDSums &sums1, const MIDSums &sums2) const
+{
+    const DISTANCE_MEASURE distanceMeasure = config.getDistanceMeasure();
+
+    if(!sums1.size || !sums2.size)
+        return 0;
+
+    if(distanceMeasure != D_EUCLIDEAN && distanceMeasure != D_MANHATTAN)
+        return 0;
+
+    const int maxAlignedSize = sums1.size + sums2.size;
+
+    double bound = std::max(fabs(sums1.sum - sums2.sum) / sqrt((double) maxAlignedSize), fabs(sums1.norm - sums2.norm));
+    if(distanceMeasure == D_MANHATTAN) {
+        bound = std::max(bound, std::max(fabs(sums1.sum - sums2.sum), fabs(sums1.absSum - sums2.absSum)));
+    }
+
+    // guard against rounding, must never exceed the actual distance
+    bound *= 1 - 1e-9;
+
+    return bound / getNormalizationDivisor(maxAlignedSize, sums1.size, sums2.size, config);
+}
+
+/**
+ * @brief Sums of the given MID for getDistanceLowerBound().
+ */
+MIDSums::MIDSums(const MIDView &mid)
+    : sum(0), absSum(0), norm(0), size(mid.size)
+{
+    double sq = 0;
+    for(int i = 0; i < mid.size; ++i) {
+        sum += mid[i];
+        absSum += fabs(mid[i]);
+        sq += mid[i] * mid[i];
+    }
+    norm = sqrt(sq);
 }
 
 /**
@@ -121,7 +789,7 @@ double MIDDistanceCalculator::getMIDDistance(std::pair<std::vector<double>, std:
  * @param size
  * @return Pair of mean and standard deviation.
  */
-std::pair<double,double> MIDDistanceCalculator::createMonteCarloModel(int len1, int len2, int size)
+std::pair<double,double> MIDDistanceCalculator::createMonteCarloModel(int len1, int len2, int size) const
 {
     alglib::real_1d_array dists;
     dists.setlength(size);
@@ -131,7 +799,7 @@ std::pair<double,double> MIDDistanceCalculator::createMonteCarloModel(int len1,
     QVector<MonteCarloHelper*> threads;
     for(int t = 0; t < QThread::idealThreadCount(); ++t) {
         int num = (t == QThread::idealThreadCount())?size - sizePerThread * t : sizePerThread; // take the rest in the last round
-        MonteCarloHelper *mch = new MonteCarloHelper(&dists[sizePerThread * t], num, len1, len2, gapPenalty);
+        MonteCarloHelper *mch = new MonteCarloHelper(&dists[sizePerThread * t], num, len1, len2, this);
         mch->start();
         threads.push_back(mch);
     }
@@ -187,7 +855,17 @@ double MIDDistanceCalculator::sum(std::vector<double>::iterator itBegin, std::ve
 std::vector<double> MIDDistanceCalculator::getNormalizedRandomVector(int size, int to)
 {
     std::vector<double> v(size);
+    getNormalizedRandomVector(v, to);
+    return v;
+}
+
+/**
+ * @brief Fill the given vector with random values, normalized to @p to.
+ */
+void MIDDistanceCalculator::getNormalizedRandomVector(std::vector<double> &v, int to)
+{
     double sum = 0;
+    int size;
    // do {
         sum = 0;
         size = v.size();
@@ -197,20 +875,89 @@ std::vector<double> MIDDistanceCalculator::getNormalizedRandomVector(int size, i
         }
    // } while(v[0] / sum < 0.45);
     normalize(v.begin(), v.end(), to);
-    return v;
 }
 
-std::pair<std::vector<double>, std::vector<double> > MIDDistanceCalculator::nw(std::vector<double> v1, std::vector<double> v2)
+/**
+ * @brief Needleman-Wunsch alignment with the configured gap penalty, banded if configured.
+ */
+std::pair<std::vector<double>, std::vector<double> > MIDDistanceCalculator::nw(const MIDView &v1, const MIDView &v2) const
+{
+    NWWorkspace &ws = workspace();
+    fillNWMatrices(v1, v2, ws);
+    int alignedSize = traceback(v1, v2, ws);
+
+    return std::pair<std::vector<double>, std::vector<double> >(
+                std::vector<double>(ws.getAligned1(), ws.getAligned1() + alignedSize),
+                std::vector<double>(ws.getAligned2(), ws.getAligned2() + alignedSize));
+}
+
+std::pair<std::vector<double>, std::vector<double> > MIDDistanceCalculator::nw(const MIDView &v1, const MIDView &v2, double gapPenalty)
+{
+    NWWorkspace &ws = workspace();
+    int alignedSize = align(v1, v2, gapPenalty, ws);
+
+    return std::pair<std::vector<double>, std::vector<double> >(
+                std::vector<double>(ws.getAligned1(), ws.getAligned1() + alignedSize),
+                std::vector<double>(ws.getAligned2(), ws.getAligned2() + alignedSize));
+}
+
+/**
+ * @brief Fills the table of length-specialized kernels, getMIDDistanceFixed<0> ... getMIDDistanceFixed<LEN2>.
+ */
+template<int LEN2>
+struct NWKernelTableFiller {
+    static void fill(MIDDistanceCalculator::NWKernel *table) {
+        table[LEN2] = &MIDDistanceCalculator::getMIDDistanceFixed<LEN2>;
+        NWKernelTableFiller<LEN2 - 1>::fill(table);
+    }
+};
+
+template<>
+struct NWKernelTableFiller<-1> {
+    static void fill(MIDDistanceCalculator::NWKernel *) {}
+};
+
+namespace {
+struct NWKernelTable {
+    NWKernelTable() { NWKernelTableFiller<MIDDistanceCalculator::maxFixedLength>::fill(kernels); }
+    MIDDistanceCalculator::NWKernel kernels[MIDDistanceCalculator::maxFixedLength + 1];
+};
+}
+
+/**
+ * @brief Get the alignment and distance kernel for MIDs of the given lengths. Kernels specialized on the length of the second MID
+ * are used if both MIDs are at most maxFixedLength long, otherwise the generic kernel using the per-thread workspace.
+ * @param len1 Length of first MID
+ * @param len2 Length of second MID
+ * @return Kernel calculating the distance for the given settings
+ */
+MIDDistanceCalculator::NWKernel MIDDistanceCalculator::getKernel(int len1, int len2)
+{
+    static const NWKernelTable table;
+
+    if(len1 > maxFixedLength || len2 > maxFixedLength)
+        return &MIDDistanceCalculator::getMIDDistanceWorkspace;
+
+    return table.kernels[len2];
+}
+
+/**
+ * @brief Per-thread alignment workspace. Created on first use in each thread.
+ */
+NWWorkspace &MIDDistanceCalculator::workspace()
 {
-    return MIDDistanceCalculator::nw<double>(v1, v2, gapPenalty);
+    static QThreadStorage<NWWorkspace> workspaces;
+    return workspaces.localData();
 }
 
 
-double MIDDistanceCalculator::getMonteCarloZScore(double distance, int size1, int size2)
+double MIDDistanceCalculator::getMonteCarloZScore(double distance, int size1, int size2) const
 {
     int s1 = std::min(size1, size2);
     int s2 = std::max(size1, size2);
 
+    QMutexLocker locker(&MCModelsMutex);
+
     // mean already calculated?
     std::map<std::pair<int, int>, std::pair<double, double> >::iterator it = MCModels.find(std::pair<int, int>(s1, s2));
     if(it == MCModels.end()) {
@@ -228,17 +975,27 @@ double MIDDistanceCalculator::getMonteCarloZScore(double distance, int size1, in
 void MonteCarloHelper::run()
 {
     // std::cerr<<"Starting "<<len1<<","<<len2<<" "<<&arr<<" "<<number<<std::endl;
+    std::vector<double> v1(len1);
+    std::vector<double> v2(len2);
+
     for(int i = 0; i < number; ++i) {
-        std::vector<double> v1 = MIDDistanceCalculator::getNormalizedRandomVector(len1, 1);
-        std::vector<double> v2 = MIDDistanceCalculator::getNormalizedRandomVector(len2, 1);
+        MIDDistanceCalculator::getNormalizedRandomVector(v1, 1);
+        MIDDistanceCalculator::getNormalizedRandomVector(v2, 1);
 
-        arr[i] = MIDDistanceCalculator::getMIDDistance(MIDDistanceCalculator::nw<double>(v1, v2, gapPenalty), v1.size(), v2.size());
+        arr[i] = distCalc->getMIDDistance(v1, v2);
     }
     // std::cerr<<"Finished "<<len1<<","<<len2<<" "<<&arr<<" "<<number<<std::endl;
 }
 
-template<class T>
-std::pair<std::vector<T>, std::vector<T> > MIDDistanceCalculator::nw(std::vector<T> v1, std::vector<T> v2, double gapPenalty) {
+/**
+ * @brief Fill Needleman-Wunsch score and traceback matrices of the given workspace.
+ * @param v1 First MID (rows)
+ * @param v2 Second MID (columns)
+ * @param gapPenalty Penalty for gap insertion
+ * @param ws Workspace to hold the matrices
+ */
+void MIDDistanceCalculator::fillNWMatrices(const MIDView &v1, const MIDView &v2, double gapPenalty, NWWorkspace &ws)
+{
     //         j  0     1     2     3    4
     //    i       0   V2[0] V2[1] V2[2] V2[3]
     //    0  0    0    gp   2gp    3gp  4gp
@@ -248,111 +1005,715 @@ std::pair<std::vector<T>, std::vector<T> > MIDDistanceCalculator::nw(std::vector
 
     // the lower the score the better
 
-    std::vector<std::vector<double> > scoreMat;
-    std::vector<std::vector<char> > tracebackMat;
-    initNWMatrices<T>(v1.size(), v2.size(), gapPenalty, scoreMat, tracebackMat);
+    const int len1 = v1.size;
+    const int len2 = v2.size;
+    const int cols = len2 + 1;
 
-    double curGapPenalty = gapPenalty;
+    ws.reserve(len1, len2);
+    double *scoreMat = ws.scoreMat.data();
+    char *tracebackMat = ws.tracebackMat.data();
+
+    // fill left and top with gap penalty
+    for(int i = 0; i <= len1; ++i) {
+        scoreMat[i * cols] = gapPenalty * i;
+        tracebackMat[i * cols] = '|';
+    }
+    for(int j = 1; j <= len2; ++j) {
+        scoreMat[j] = gapPenalty * j;
+        tracebackMat[j] = '-';
+    }
+    tracebackMat[0] = 'N';
 
     // do actual stuff
-    for(int i = 1; i <= v1.size(); ++i) { // row
-        for(int j = 1; j <= v2.size(); ++j) { // col
-            double sright, sdown, sdiag; // scores
+    for(int i = 1; i <= len1; ++i) { // row
+        const double *prevRow = scoreMat + (i - 1) * cols;
+        double *curRow = scoreMat + i * cols;
+        char *tracebackRow = tracebackMat + i * cols;
 
-            // had gap before? make consecutive gaps less expensive
-            //if((j > 1 && scoreMat[i][j-2] < scoreMat[i-1][j-1]) || (scoreMat[i-1][j-1] < scoreMat[i-1][j-1])) curGapPenalty = gapPenalty / 10;
-            //else curGapPenalty = gapPenalty;
+        // make tailing gaps less expensive:
+        const double gapRight = (i == len1) ? 0 : gapPenalty;
+
+        for(int j = 1; j <= len2; ++j) { // col
             // go right?
-            sright = scoreMat[i][j - 1] + curGapPenalty;
+            double sright = curRow[j - 1] + gapRight;
+            // go down? make tailing gaps less expensive
+            double sdown = prevRow[j] + ((j == len2) ? 0 : gapPenalty);
+            // go diagonal?
+            double sdiag = prevRow[j - 1] + nwScoreMID(v1[i - 1], v2[j - 1]); // -1 because of initial 0 in matrix
 
-            // make tailing gaps less expensive:
-            if(i == v1.size()) sright = scoreMat[i][j - 1];
+            // least expensive path?
+            if(sdown < sright) {
+                if(sdown <= sdiag) {
+                    curRow[j] = sdown;
+                    tracebackRow[j] = '|';
+                } else {
+                    curRow[j] = sdiag;
+                    tracebackRow[j] = '\\';
+                }
+            } else {
+                if(sright <= sdiag) {
+                    curRow[j] = sright;
+                    tracebackRow[j] = '-';
+                } else {
+                    curRow[j] = sdiag;
+                    tracebackRow[j] = '\\';
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Fill Needleman-Wunsch score and traceback matrices for GM_CONSECUTIVE_GAP_DISCOUNT.
+ *
+ * Unlike fillNWMatrices(const MIDView &, const MIDView &, double, NWWorkspace &), tailing gaps cost the full gap penalty,
+ * while a gap costs only a tenth of it if the cell two steps back in the direction of the gap scores better than the
+ * diagonal predecessor. The traceback does not follow the move taken during the fill, but steps to the best scoring
+ * neighbor, preferring diagonal, then down, then right.
+ *
+ * @param v1 First MID (rows)
+ * @param v2 Second MID (columns)
+ * @param gapPenalty Penalty for gap insertion
+ * @param ws Workspace to hold the matrices
+ */
+void MIDDistanceCalculator::fillNWMatricesConsecutiveGapDiscount(const MIDView &v1, const MIDView &v2, double gapPenalty, NWWorkspace &ws)
+{
+    const int len1 = v1.size;
+    const int len2 = v2.size;
+    const int cols = len2 + 1;
 
+    ws.reserve(len1, len2);
+    double *scoreMat = ws.scoreMat.data();
+    char *tracebackMat = ws.tracebackMat.data();
+
+    // fill left and top with gap penalty
+    for(int i = 0; i <= len1; ++i) {
+        scoreMat[i * cols] = gapPenalty * i;
+        tracebackMat[i * cols] = '|';
+    }
+    for(int j = 1; j <= len2; ++j) {
+        scoreMat[j] = gapPenalty * j;
+        tracebackMat[j] = '-';
+    }
+    tracebackMat[0] = 'N';
+
+    for(int i = 1; i <= len1; ++i) { // row
+        const double *prevRow = scoreMat + (i - 1) * cols;
+        double *curRow = scoreMat + i * cols;
+        char *tracebackRow = tracebackMat + i * cols;
+
+        for(int j = 1; j <= len2; ++j) { // col
             // had gap before? make consecutive gaps less expensive
-            //if((scoreMat[i-1][j-1] < scoreMat[i-1][j-1]) || (i > 1 && scoreMat[i-2][j-1] < scoreMat[i-1][j-1])) curGapPenalty = gapPenalty / 10;
-            //else curGapPenalty = gapPenalty;
-            // go down?
-            sdown = scoreMat[i - 1][j] + curGapPenalty;
-            // make tailing gaps less expensive:
-            if(j == v2.size()) sdown = scoreMat[i - 1][j];
+            double sright = curRow[j - 1] + ((j > 1 && curRow[j - 2] < prevRow[j - 1]) ? gapPenalty / 10 : gapPenalty);
+            double sdown = prevRow[j] + ((i > 1 && prevRow[j - 1 - cols] < prevRow[j - 1]) ? gapPenalty / 10 : gapPenalty);
+            double sdiag = prevRow[j - 1] + nwScoreMID(v1[i - 1], v2[j - 1]);
+            curRow[j] = min<double>(sright, sdown, sdiag);
 
-            // go diagonal?
-            sdiag = scoreMat[i - 1][j - 1] + nwScoreMID(v1[i - 1], v2[j - 1]); // -1 because of initial 0 in matrix
+            // best neighbor, all of them are final by now
+            double mn = min<double>(curRow[j - 1], prevRow[j], prevRow[j - 1]);
+            if(mn == prevRow[j - 1])
+                tracebackRow[j] = '\\';
+            else if(mn == prevRow[j])
+                tracebackRow[j] = '|';
+            else
+                tracebackRow[j] = '-';
+        }
+    }
+}
+
+/**
+ * @brief Fill Needleman-Wunsch matrices with the configured gap penalty and gap model. Restricted to the configured band
+ * (see getBand()), if any, with fallback to the full matrices if the banded alignment is not provably optimal.
+ */
+void MIDDistanceCalculator::fillNWMatrices(const MIDView &v1, const MIDView &v2, NWWorkspace &ws) const
+{
+    if(config.getGapModel() == GM_CONSECUTIVE_GAP_DISCOUNT) {
+        fillNWMatricesConsecutiveGapDiscount(v1, v2, config.getGapPenalty(), ws);
+        return;
+    }
+
+    int lo, hi;
+    if(getBand(v1.size, v2.size, lo, hi) && fillNWMatricesBanded(v1, v2, config.getGapPenalty(), lo, hi, ws))
+        return;
+
+    fillNWMatrices(v1, v2, config.getGapPenalty(), ws);
+}
+
+/**
+ * @brief Same as fillNWMatrices(), but only for the cells with lo <= j - i <= hi, cells outside the band count as infinitely expensive.
+ *
+ * Diagonal steps never change j - i, so a path leaving the band needs at least hi + 1 horizontal or 1 - lo vertical gaps
+ * first. As the band contains the end of the alignment, none of these can be the cheaper tailing gaps, hence every path
+ * through a cell outside the band costs at least gapPenalty * min(hi + 1, 1 - lo). If the banded alignment is cheaper,
+ * no cell on its traceback nor any alternative considered there can be affected by cells outside the band, and the
+ * traceback is exactly the one of fillNWMatrices().
+ *
+ * @param v1 First MID (rows)
+ * @param v2 Second MID (columns)
+ * @param gapPenalty Penalty for gap insertion
+ * @param lo Lowest diagonal in the band, at most min(0, v2.size - v1.size)
+ * @param hi Highest diagonal in the band, at least max(0, v2.size - v1.size)
+ * @param ws Workspace to hold the matrices
+ * @return true if the banded alignment is optimal, false if fillNWMatrices() is required
+ */
+bool MIDDistanceCalculator::fillNWMatricesBanded(const MIDView &v1, const MIDView &v2, double gapPenalty, int lo, int hi, NWWorkspace &ws)
+{
+    const int len1 = v1.size;
+    const int len2 = v2.size;
+    const int cols = len2 + 1;
+    const double inf = std::numeric_limits<double>::infinity();
+    assert(lo <= 0 && lo <= len2 - len1 && hi >= 0 && hi >= len2 - len1);
+
+    ws.reserve(len1, len2);
+    double *scoreMat = ws.scoreMat.data();
+    char *tracebackMat = ws.tracebackMat.data();
+
+    // fill top with gap penalty
+    for(int j = 0; j <= std::min(len2, hi); ++j) {
+        scoreMat[j] = gapPenalty * j;
+        tracebackMat[j] = '-';
+    }
+    tracebackMat[0] = 'N';
+
+    for(int i = 1; i <= len1; ++i) { // row
+        double *prevRow = scoreMat + (i - 1) * cols;
+        double *curRow = scoreMat + i * cols;
+        char *tracebackRow = tracebackMat + i * cols;
+        int jBegin = i + lo;
+        const int jEnd = std::min(len2, i + hi);
+
+        // neighbours outside the band
+        if(jEnd == i + hi)
+            prevRow[jEnd] = inf;
+        if(jBegin > 0) {
+            curRow[jBegin - 1] = inf;
+        } else {
+            curRow[0] = gapPenalty * i;
+            tracebackRow[0] = '|';
+            jBegin = 1;
+        }
+
+        // make tailing gaps less expensive:
+        const double gapRight = (i == len1) ? 0 : gapPenalty;
+
+        for(int j = jBegin; j <= jEnd; ++j) { // col
+            double sright = curRow[j - 1] + gapRight;
+            double sdown = prevRow[j] + ((j == len2) ? 0 : gapPenalty);
+            double sdiag = prevRow[j - 1] + nwScoreMID(v1[i - 1], v2[j - 1]);
 
-            // least expensive path?
             if(sdown < sright) {
                 if(sdown <= sdiag) {
-                    scoreMat[i][j] = sdown;
-                    tracebackMat[i][j] = '|';
+                    curRow[j] = sdown;
+                    tracebackRow[j] = '|';
                 } else {
-                    scoreMat[i][j] = sdiag;
-                    tracebackMat[i][j] = '\\';
+                    curRow[j] = sdiag;
+                    tracebackRow[j] = '\\';
                 }
             } else {
                 if(sright <= sdiag) {
-                    scoreMat[i][j] = sright;
-                    tracebackMat[i][j] = '-';
+                    curRow[j] = sright;
+                    tracebackRow[j] = '-';
                 } else {
-                    scoreMat[i][j] = sdiag;
-                    tracebackMat[i][j] = '\\';
+                    curRow[j] = sdiag;
+                    tracebackRow[j] = '\\';
                 }
             }
-            //printMat(scoreMat);
-            //printMat(tracebackMat);
-            //std::cerr<<std::endl;
         }
     }
 
-    // retrace best alignment, start at bottom right
-    std::vector<T> alV1, alV2;
-    int i = v1.size(); // matrix is v1.size + 1
-    int j = v2.size();
-    int gaps = 0;
+    // cheapest path leaving the band; sides that cannot be left do not count
+    double bound = inf;
+    if(hi < len2)
+        bound = gapPenalty * (hi + 1);
+    if(lo > -len1)
+        bound = std::min(bound, gapPenalty * (1 - lo));
+
+    // guard against rounding, must never accept a suboptimal alignment
+    return scoreMat[len1 * cols + len2] < bound * (1 - 1e-9);
+}
+
+/**
+ * @brief Needleman-Wunsch alignment of two MIDs using the given workspace. Does not allocate if the workspace is large enough.
+ * @param v1 First MID
+ * @param v2 Second MID
+ * @param gapPenalty Penalty for gap insertion
+ * @param ws Workspace, holds the aligned MIDs afterwards (see NWWorkspace::getAligned1(), NWWorkspace::getAligned2())
+ * @return Length of the aligned MIDs
+ */
+int MIDDistanceCalculator::align(const MIDView &v1, const MIDView &v2, double gapPenalty, NWWorkspace &ws)
+{
+    fillNWMatrices(v1, v2, gapPenalty, ws);
+
+    return traceback(v1, v2, ws);
+}
+
+/**
+ * @brief Build the aligned MIDs from the traceback matrix of the given workspace.
+ * @param v1 First MID
+ * @param v2 Second MID
+ * @param ws Workspace with filled matrices, holds the aligned MIDs afterwards
+ * @return Length of the aligned MIDs
+ */
+int MIDDistanceCalculator::traceback(const MIDView &v1, const MIDView &v2, NWWorkspace &ws)
+{
+    const int len1 = v1.size;
+    const int len2 = v2.size;
+    const int cols = len2 + 1;
+    const char *tracebackMat = ws.tracebackMat.data();
+
+    // retrace best alignment, start at bottom right; fill from the back, so no need to reverse
+    double *alV1 = ws.aligned1.data();
+    double *alV2 = ws.aligned2.data();
+    int pos = len1 + len2;
+    int i = len1; // matrix is v1.size + 1
+    int j = len2;
     while(i > 0 || j > 0) { // i: row, v1 ; j: col, v2
-        switch(tracebackMat[i][j]) {
+        --pos;
+        switch(tracebackMat[i * cols + j]) {
         case '\\':
-            alV1.push_back(v1[--i]);
-            alV2.push_back(v2[--j]);
+            alV1[pos] = v1[--i];
+            alV2[pos] = v2[--j];
             break;
         case '|':
-            alV1.push_back(v1[--i]);
-            alV2.push_back(0);
-            ++gaps;
+            alV1[pos] = v1[--i];
+            alV2[pos] = 0;
             break;
         case '-':
-            alV1.push_back(0);
-            alV2.push_back(v2[--j]);
-            ++gaps;
+            alV1[pos] = 0;
+            alV2[pos] = v2[--j];
             break;
         default:
-            std::cerr<<"MIDDistanceCalculator::nw: severe problem.\n";
+            std::cerr<<"MIDDistanceCalculator::traceback: severe problem.\n";
             abort();
         }
     }
-    std::reverse(alV1.begin(), alV1.end());
-    std::reverse(alV2.begin(), alV2.end());
+    ws.alignedBegin = pos;
 
-    return std::pair<std::vector<T>, std::vector<T> >(alV1, alV2);
+    return len1 + len2 - pos;
 }
 
-template<class T>
-void MIDDistanceCalculator::initNWMatrices(int size1, int size2, double gapPenalty, std::vector<std::vector<T> > &scoreMat, std::vector<std::vector<char> > &tracebackMat)
+/**
+ * @brief Walk the given traceback once and calculate the normalized distance according to the distance measure of @p config.
+ * @param v1 First MID
+ * @param v2 Second MID
+ * @param tb Traceback matrix accessor
+ * @param config Distance settings
+ * @return Normalized distance
+ */
+template<class Traceback>
+double MIDDistanceCalculator::scoreTraceback(const MIDView &v1, const MIDView &v2, const Traceback &tb, const Config &config)
+{
+    switch(config.getDistanceMeasure()) {
+    case D_CANBERRA:
+        return scoreTracebackWith<CanberraMeasure>(v1, v2, tb, config);
+    case D_MANHATTAN:
+        return scoreTracebackWith<ManhattanMeasure>(v1, v2, tb, config);
+    case D_COSINE:
+        return scoreTracebackWith<CosineMeasure>(v1, v2, tb, config);
+    case D_CUSTOM:
+        return scoreTracebackWith<CustomMeasure>(v1, v2, tb, config);
+    case D_CI_WEIGHTED:
+        return scoreTracebackWith<CIWeightedMeasure>(v1, v2, tb, config);
+    case D_EUCLIDEAN:
+    default:
+        return scoreTracebackWith<EuclideanMeasure>(v1, v2, tb, config);
+    }
+}
+
+/**
+ * @brief scoreTraceback() for @p Measure and the distance normalization of @p config.
+ */
+template<class Measure, class Traceback>
+double MIDDistanceCalculator::scoreTracebackWith(const MIDView &v1, const MIDView &v2, const Traceback &tb, const Config &config)
 {
-    // resize, fill left and top with gap penalty
-    scoreMat.resize(size1 + 1); // need 0
-    tracebackMat.resize(scoreMat.size());
-    for(int i = 0; i <= size1; ++i) {
-        scoreMat[i].resize(size2 + 1);
-        scoreMat[i][0] = gapPenalty * i;
+    switch(config.getDistanceNormalization()) {
+    case DN_ONE:
+        return accumulateDistance<Measure, OneNormalization>(v1, v2, tb);
+    case DN_PROD:
+        return accumulateDistance<Measure, ProdNormalization>(v1, v2, tb);
+    case DN_MAX:
+        return accumulateDistance<Measure, MaxNormalization>(v1, v2, tb);
+    case DN_MIN:
+        return accumulateDistance<Measure, MinNormalization>(v1, v2, tb);
+    case DN_SUM:
+    default:
+        return accumulateDistance<Measure, SumNormalization>(v1, v2, tb);
+    }
+}
 
-        tracebackMat[i].resize(scoreMat[i].size());
-        tracebackMat[i][0] = '|';
+/**
+ * @brief Like scoreTraceback(const MIDView &, const MIDView &, const Traceback &, const Config &), additionally recording the path if @p path is given.
+ */
+template<class Traceback>
+double MIDDistanceCalculator::scoreTraceback(const MIDView &v1, const MIDView &v2, const Traceback &tb, const Config &config, AlignmentPath *path)
+{
+    if(path)
+        return scoreTraceback(v1, v2, RecordingTraceback<Traceback>(tb, *path), config);
+
+    return scoreTraceback(v1, v2, tb, config);
+}
+
+/**
+ * @brief Walk the traceback once and accumulate the distance of the aligned MIDs on the fly.
+ * @p tb is called exactly once per step, in traceback order.
+ * @param v1 First MID
+ * @param v2 Second MID
+ * @param tb Traceback matrix accessor
+ * @return Distance according to @p Measure, normalized according to @p Normalization
+ */
+template<class Measure, class Normalization, class Traceback>
+double MIDDistanceCalculator::accumulateDistance(const MIDView &v1, const MIDView &v2, const Traceback &tb)
+{
+    Measure m;
+    int alignedSize = 0;
+    int i = v1.size;
+    int j = v2.size;
+    while(i > 0 || j > 0) {
+        switch(tb(i, j)) {
+        case '\\':
+            --i; --j;
+            addAligned(m, v1[i], v2[j], v1.getCI(i), v2.getCI(j));
+            break;
+        case '|':
+            --i;
+            addAligned(m, v1[i], 0, v1.getCI(i), 0);
+            break;
+        case '-':
+            --j;
+            addAligned(m, 0, v2[j], 0, v2.getCI(j));
+            break;
+        default:
+            std::cerr<<"MIDDistanceCalculator::accumulateDistance: severe problem.\n";
+            abort();
+        }
+        ++alignedSize;
     }
-    for(int j = 1; j <= size2; ++j) {
-        scoreMat[0][j] = gapPenalty * j;
-        tracebackMat[0][j] = '-';
+
+    return fabs(m.result(alignedSize) / normalizationDivisor<Normalization>(alignedSize, v1.size, v2.size));
+}
+
+/**
+ * @brief Alignment and distance calculation for MIDs of length @p LEN2 (second MID) and at most maxFixedLength (first MID).
+ * DP tables live on the stack, the inner loop has a compile-time trip count. Same results as getMIDDistanceWorkspace().
+ * @param mid1 First MID
+ * @param mid2 Second MID, must be of length @p LEN2
+ * @param config Gap penalty, distance measure and normalization
+ * @return Normalized distance according to @p config
+ */
+template<int LEN2>
+double MIDDistanceCalculator::getMIDDistanceFixed(const MIDView &mid1, const MIDView &mid2, const Config &config)
+{
+    const int COLS = LEN2 + 1;
+    const int len1 = mid1.size;
+    const double gapPenalty = config.getGapPenalty();
+    assert(mid2.size == LEN2 && len1 <= maxFixedLength);
+
+    double rows[2][COLS];
+    char tracebackMat[(maxFixedLength + 1) * COLS];
+
+    // fill top with gap penalty
+    double *prev = rows[0];
+    double *cur = rows[1];
+    for(int j = 0; j < COLS; ++j) {
+        prev[j] = gapPenalty * j;
+        tracebackMat[j] = '-';
+    }
+
+    for(int i = 1; i <= len1; ++i) { // row
+        char *tracebackRow = tracebackMat + i * COLS;
+        cur[0] = gapPenalty * i;
+        tracebackRow[0] = '|';
+
+        // make tailing gaps less expensive:
+        const double gapRight = (i == len1) ? 0 : gapPenalty;
+        const float a = mid1[i - 1];
+
+        for(int j = 1; j < COLS; ++j) { // col
+            double sright = cur[j - 1] + gapRight;
+            double sdown = prev[j] + ((j == LEN2) ? 0 : gapPenalty);
+            double sdiag = prev[j - 1] + nwScoreMID(a, mid2[j - 1]);
+
+            if(sdown < sright) {
+                if(sdown <= sdiag) {
+                    cur[j] = sdown;
+                    tracebackRow[j] = '|';
+                } else {
+                    cur[j] = sdiag;
+                    tracebackRow[j] = '\\';
+                }
+            } else {
+                if(sright <= sdiag) {
+                    cur[j] = sright;
+                    tracebackRow[j] = '-';
+                } else {
+                    cur[j] = sdiag;
+                    tracebackRow[j] = '\\';
+                }
+            }
+        }
+        std::swap(prev, cur);
+    }
+
+    return scoreTraceback(mid1, mid2, NWFixedTraceback<COLS>(tracebackMat), config);
+}
+
+/**
+ * @brief Same as fillNWMatrices(), but additionally tracks the partial distance (sum of Measure::term) of the path to each cell
+ * and stops once all partial distances of a row exceed @p limit.
+ * @param v1 First MID (rows)
+ * @param v2 Second MID (columns)
+ * @param gapPenalty Penalty for gap insertion
+ * @param limit Limit for the unnormalized partial distance
+ * @param ws Workspace to hold the matrices
+ * @return false if abandoned, true if the matrices are complete
+ */
+template<class Measure>
+bool MIDDistanceCalculator::fillNWMatricesAbandon(const MIDView &v1, const MIDView &v2, double gapPenalty, double limit, NWWorkspace &ws)
+{
+    const int len1 = v1.size;
+    const int len2 = v2.size;
+    const int cols = len2 + 1;
+
+    ws.reserve(len1, len2);
+    double *scoreMat = ws.scoreMat.data();
+    char *tracebackMat = ws.tracebackMat.data();
+    double *prevPartial = ws.partialRows.data();
+    double *curPartial = prevPartial + cols;
+
+    // fill top with gap penalty
+    for(int j = 0; j <= len2; ++j) {
+        scoreMat[j] = gapPenalty * j;
+        tracebackMat[j] = '-';
+    }
+    tracebackMat[0] = 'N';
+    prevPartial[0] = 0;
+    for(int j = 1; j <= len2; ++j)
+        prevPartial[j] = prevPartial[j - 1] + Measure::term(0, v2[j - 1]);
+
+    for(int i = 1; i <= len1; ++i) { // row
+        const double *prevRow = scoreMat + (i - 1) * cols;
+        double *curRow = scoreMat + i * cols;
+        char *tracebackRow = tracebackMat + i * cols;
+
+        curRow[0] = gapPenalty * i;
+        tracebackRow[0] = '|';
+        curPartial[0] = prevPartial[0] + Measure::term(v1[i - 1], 0);
+        double rowMin = curPartial[0];
+
+        // make tailing gaps less expensive:
+        const double gapRight = (i == len1) ? 0 : gapPenalty;
+
+        for(int j = 1; j <= len2; ++j) { // col
+            double sright = curRow[j - 1] + gapRight;
+            double sdown = prevRow[j] + ((j == len2) ? 0 : gapPenalty);
+            double sdiag = prevRow[j - 1] + nwScoreMID(v1[i - 1], v2[j - 1]);
+
+            if(sdown < sright && sdown <= sdiag) {
+                curRow[j] = sdown;
+                tracebackRow[j] = '|';
+                curPartial[j] = prevPartial[j] + Measure::term(v1[i - 1], 0);
+            } else if(!(sdown < sright) && sright <= sdiag) {
+                curRow[j] = sright;
+                tracebackRow[j] = '-';
+                curPartial[j] = curPartial[j - 1] + Measure::term(0, v2[j - 1]);
+            } else {
+                curRow[j] = sdiag;
+                tracebackRow[j] = '\\';
+                curPartial[j] = prevPartial[j - 1] + Measure::term(v1[i - 1], v2[j - 1]);
+            }
+            rowMin = curPartial[j] < rowMin ? curPartial[j] : rowMin;
+        }
+
+        // the final path passes through this row
+        if(rowMin > limit)
+            return false;
+
+        std::swap(prevPartial, curPartial);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Fill the traceback matrix for aligning one MID against up to batchSize others at once. Lane k of the score matrix
+ * holds the Needleman-Wunsch scores of @p v1 vs. @p v2[k], shorter MIDs are padded with zeros. Scores are bitwise identical
+ * to fillNWMatrices().
+ * @param v1 First MID (rows)
+ * @param v2 Array of @p count MIDs (columns)
+ * @param gapPenalties Penalty for gap insertion, for each MID in @p v2
+ * @param count Number of MIDs in @p v2, at most batchSize
+ * @param ws Workspace to hold the matrices
+ */
+void MIDDistanceCalculator::fillNWMatricesBatch(const MIDView &v1, const MIDView *v2, const double *gapPenalties, int count, NWWorkspace &ws)
+{
+    const int B = batchSize;
+    const int len1 = v1.size;
+    int len2 = 0;
+    for(int k = 0; k < count; ++k)
+        len2 = std::max(len2, v2[k].size);
+    const int cols = len2 + 1;
+
+    ws.reserveBatch(len1, len2);
+    double *prev = ws.batchScoreRows.data();
+    double *cur = prev + cols * B;
+    unsigned char *tracebackMat = ws.batchTracebackMat.data();
+    float *columns = ws.batchColumns.data();
+    double *gapDown = ws.batchGapDown.data();
+    double gaps[B];
+    for(int k = 0; k < B; ++k)
+        gaps[k] = k < count ? gapPenalties[k] : 0;
+
+    // interleave MIDs; same float conversion as nwScoreMID
+    for(int j = 0; j < len2; ++j) {
+        for(int k = 0; k < B; ++k) {
+            columns[j * B + k] = (k < count && j < v2[k].size) ? v2[k][j] : 0;
+        }
+    }
+    // make tailing gaps less expensive, individually for each lane
+    for(int j = 1; j <= len2; ++j) {
+        for(int k = 0; k < B; ++k) {
+            gapDown[j * B + k] = (k < count && j == v2[k].size) ? 0 : gaps[k];
+        }
+    }
+
+    // fill left and top with gap penalty
+    for(int j = 0; j <= len2; ++j) {
+        for(int k = 0; k < B; ++k)
+            prev[j * B + k] = gaps[k] * j;
+        tracebackMat[j] = 0xF0; // '-'
+    }
+
+    for(int i = 1; i <= len1; ++i) { // row
+        unsigned char *tracebackRow = tracebackMat + i * cols;
+        tracebackRow[0] = 0xFF; // '|'
+        for(int k = 0; k < B; ++k)
+            cur[k] = gaps[k] * i;
+
+        // make tailing gaps less expensive:
+        double gapRight[B];
+        for(int k = 0; k < B; ++k)
+            gapRight[k] = (i == len1) ? 0 : gaps[k];
+        const float a = v1[i - 1];
+
+#if defined(__AVX__)
+        const __m256d gr = _mm256_loadu_pd(gapRight);
+        const __m128 av = _mm_set1_ps(a);
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m256d left = _mm256_loadu_pd(cur);
+        for(int j = 1; j <= len2; ++j) { // col
+            __m256d sright = _mm256_add_pd(left, gr);
+            __m256d sdown = _mm256_add_pd(_mm256_loadu_pd(prev + j * B), _mm256_loadu_pd(gapDown + j * B));
+            __m128 diff = _mm_and_ps(_mm_sub_ps(av, _mm_loadu_ps(columns + (j - 1) * B)), absMask);
+            __m256d sdiag = _mm256_add_pd(_mm256_loadu_pd(prev + (j - 1) * B), _mm256_cvtps_pd(diff));
+
+            __m256d down = _mm256_cmp_pd(sdown, sright, _CMP_LT_OQ);
+            __m256d best = _mm256_blendv_pd(sright, sdown, down);
+            __m256d noDiag = _mm256_cmp_pd(best, sdiag, _CMP_LE_OQ);
+            left = _mm256_blendv_pd(sdiag, best, noDiag);
+
+            _mm256_storeu_pd(cur + j * B, left);
+            tracebackRow[j] = _mm256_movemask_pd(down) | (_mm256_movemask_pd(noDiag) << 4);
+        }
+#elif defined(__SSE2__)
+        const __m128d grLo = _mm_loadu_pd(gapRight);
+        const __m128d grHi = _mm_loadu_pd(gapRight + 2);
+        const __m128 av = _mm_set1_ps(a);
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128d leftLo = _mm_loadu_pd(cur);
+        __m128d leftHi = _mm_loadu_pd(cur + 2);
+        for(int j = 1; j <= len2; ++j) { // col
+            __m128 diff = _mm_and_ps(_mm_sub_ps(av, _mm_loadu_ps(columns + (j - 1) * B)), absMask);
+
+            __m128d srightLo = _mm_add_pd(leftLo, grLo);
+            __m128d sdownLo = _mm_add_pd(_mm_loadu_pd(prev + j * B), _mm_loadu_pd(gapDown + j * B));
+            __m128d sdiagLo = _mm_add_pd(_mm_loadu_pd(prev + (j - 1) * B), _mm_cvtps_pd(diff));
+            __m128d downLo = _mm_cmplt_pd(sdownLo, srightLo);
+            __m128d bestLo = _mm_or_pd(_mm_and_pd(downLo, sdownLo), _mm_andnot_pd(downLo, srightLo));
+            __m128d noDiagLo = _mm_cmple_pd(bestLo, sdiagLo);
+            leftLo = _mm_or_pd(_mm_and_pd(noDiagLo, bestLo), _mm_andnot_pd(noDiagLo, sdiagLo));
+
+            __m128d srightHi = _mm_add_pd(leftHi, grHi);
+            __m128d sdownHi = _mm_add_pd(_mm_loadu_pd(prev + j * B + 2), _mm_loadu_pd(gapDown + j * B + 2));
+            __m128d sdiagHi = _mm_add_pd(_mm_loadu_pd(prev + (j - 1) * B + 2), _mm_cvtps_pd(_mm_movehl_ps(diff, diff)));
+            __m128d downHi = _mm_cmplt_pd(sdownHi, srightHi);
+            __m128d bestHi = _mm_or_pd(_mm_and_pd(downHi, sdownHi), _mm_andnot_pd(downHi, srightHi));
+            __m128d noDiagHi = _mm_cmple_pd(bestHi, sdiagHi);
+            leftHi = _mm_or_pd(_mm_and_pd(noDiagHi, bestHi), _mm_andnot_pd(noDiagHi, sdiagHi));
+
+            _mm_storeu_pd(cur + j * B, leftLo);
+            _mm_storeu_pd(cur + j * B + 2, leftHi);
+            tracebackRow[j] = (_mm_movemask_pd(downLo) | (_mm_movemask_pd(downHi) << 2))
+                    | ((_mm_movemask_pd(noDiagLo) | (_mm_movemask_pd(noDiagHi) << 2)) << 4);
+        }
+#else
+        for(int j = 1; j <= len2; ++j) { // col
+            unsigned char t = 0;
+            for(int k = 0; k < B; ++k) {
+                double sright = cur[(j - 1) * B + k] + gapRight[k];
+                double sdown = prev[j * B + k] + gapDown[j * B + k];
+                double sdiag = prev[(j - 1) * B + k] + nwScoreMID(a, columns[(j - 1) * B + k]);
+                bool down = sdown < sright;
+                double best = down ? sdown : sright;
+                bool noDiag = best <= sdiag;
+                cur[j * B + k] = noDiag ? best : sdiag;
+                t |= (down << k) | (noDiag << (4 + k));
+            }
+            tracebackRow[j] = t;
+        }
+#endif
+        std::swap(prev, cur);
+    }
+}
+
+/**
+ * @brief Create workspace for MIDs up to the given length.
+ * @param maxLength Maximum expected MID length.
+ */
+NWWorkspace::NWWorkspace(int maxLength)
+    : alignedBegin(0)
+{
+    reserve(maxLength, maxLength);
+}
+
+/**
+ * @brief Make sure the buffers are large enough for aligning MIDs of the given lengths. Never shrinks.
+ */
+void NWWorkspace::reserve(int len1, int len2)
+{
+    size_t matSize = (len1 + 1) * (len2 + 1);
+    if(scoreMat.size() < matSize) {
+        scoreMat.resize(matSize);
+        tracebackMat.resize(matSize);
+    }
+
+    size_t alSize = std::max(len1 + len2, 1);
+    if(aligned1.size() < alSize) {
+        aligned1.resize(alSize);
+        aligned2.resize(alSize);
+    }
+
+    if(partialRows.size() < 2 * (len2 + 1))
+        partialRows.resize(2 * (len2 + 1));
+}
+
+/**
+ * @brief Make sure the batch buffers are large enough for aligning a MID of length @p len1 against MIDs up to length @p len2.
+ * Never shrinks.
+ */
+void NWWorkspace::reserveBatch(int len1, int len2)
+{
+    const int B = MIDDistanceCalculator::batchSize;
+
+    size_t matSize = (len1 + 1) * (len2 + 1);
+    if(batchTracebackMat.size() < matSize)
+        batchTracebackMat.resize(matSize);
+
+    size_t rowSize = (len2 + 1) * B;
+    if(batchGapDown.size() < rowSize) {
+        batchScoreRows.resize(2 * rowSize);
+        batchGapDown.resize(rowSize);
+        batchColumns.resize(rowSize);
     }
-    tracebackMat[0][0] = 'N';
 }
 
 template<class T>
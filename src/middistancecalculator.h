@@ -24,16 +24,150 @@
 #include <map>
 
 #include <QThread>
+#include <QMutex>
 
 #include "alg/ap.h"
+#include "config.h"
 
 namespace mia {
 
 class MIDDistanceCalculator;
 class MonteCarloHelper;
+class MIDView;
+class NWWorkspace;
+class AlignmentTraceSink;
+
+/**
+ * @brief The MIDView class is a non-owning (pointer, length) view on a mass isotopomer distribution.
+ */
+class MIDView
+{
+public:
+    MIDView() : data(0), size(0), ci(0) {}
+    MIDView(const double *data, int size, const double *ci = 0) : data(data), size(size), ci(ci) {}
+    MIDView(const std::vector<double> &v) : data(v.data()), size(v.size()), ci(0) {}
+
+    double operator[](int i) const { return data[i]; }
+
+    /** Confidence interval of abundance @p i, 0 if none are available. */
+    double getCI(int i) const { return ci ? ci[i] : 0; }
+
+    const double *data; /**< First abundance. */
+    int size;           /**< Number of mass isotopomers. */
+    const double *ci;   /**< Confidence intervals of the @p size abundances, or 0. Only used by MIDDistanceCalculator::D_CI_WEIGHTED. */
+};
+
+/**
+ * @brief The AlignmentPath class is a compact representation of a Needleman-Wunsch traceback path, two bits per step
+ * in traceback order (from the end of the alignment). Allows recalculating distances without aligning again.
+ */
+class AlignmentPath
+{
+public:
+    static const int maxLength = 64; /**< Maximum number of steps that can be stored. */
+
+    AlignmentPath() { clear(); }
+
+    void clear() { ops[0] = ops[1] = 0; }
+
+    /** Whether a path is stored. Longer paths than maxLength and empty alignments are not stored. */
+    bool isValid() const { return ops[0] != 0; }
+
+    /** Set step @p pos to one of '\\', '|', '-'. Steps must be set in order, invalidates the path if @p pos exceeds maxLength. */
+    void set(int pos, char op) {
+        if(pos >= maxLength) {
+            clear();
+            return;
+        }
+        unsigned long long code = op == '\\' ? 1 : (op == '|' ? 2 : 3);
+        ops[pos / 32] |= code << (2 * (pos % 32));
+    }
+
+    /** Step @p pos or 0 after the last step. */
+    char get(int pos) const {
+        if(pos >= maxLength)
+            return 0;
+        switch((ops[pos / 32] >> (2 * (pos % 32))) & 3) {
+        case 1: return '\\';
+        case 2: return '|';
+        case 3: return '-';
+        default: return 0;
+        }
+    }
+
+private:
+    unsigned long long ops[2]; /**< 2-bit step codes, 0 terminates */
+};
+
+/**
+ * @brief The MIDSums class holds the sums of a MID needed for MIDDistanceCalculator::getDistanceLowerBound, so bounds
+ * of many pairs can be calculated without going over the MIDs again.
+ */
+class MIDSums
+{
+public:
+    MIDSums() : sum(0), absSum(0), norm(0), size(0) {}
+    MIDSums(const MIDView &mid);
+
+    double sum;     /**< Sum of abundances. */
+    double absSum;  /**< Sum of absolute abundances. */
+    double norm;    /**< Euclidean norm. */
+    int size;       /**< Number of mass isotopomers. */
+};
+
+/**
+ * @brief The NWWorkspace class holds flat score and traceback matrices and the aligned output for MIDDistanceCalculator::align.
+ * Buffers only grow, so after the first alignment of maximum size no more heap allocations happen. Not thread-safe, use one per thread,
+ * see MIDDistanceCalculator::workspace().
+ */
+class NWWorkspace
+{
+public:
+    NWWorkspace(int maxLength = LID_MAX_MASS_ISOTOPOMER + 1);
+
+    void reserve(int len1, int len2);
+
+    const double *getAligned1() const { return &aligned1[alignedBegin]; }
+    const double *getAligned2() const { return &aligned2[alignedBegin]; }
+
+    std::vector<double> scoreMat;   /**< (len1 + 1) x (len2 + 1) score matrix, row-major. */
+    std::vector<char> tracebackMat; /**< (len1 + 1) x (len2 + 1) traceback matrix, row-major. */
+    std::vector<double> aligned1;   /**< Aligned first MID, filled from the back. */
+    std::vector<double> aligned2;   /**< Aligned second MID, filled from the back. */
+    int alignedBegin;               /**< Index of the first aligned element of the last alignment. */
+    std::vector<double> partialRows; /**< Two rows of partial distances for early abandoning. */
+
+    void reserveBatch(int len1, int len2);
+
+    std::vector<double> batchScoreRows;             /**< Two interleaved score matrix rows for batch alignment. */
+    std::vector<unsigned char> batchTracebackMat;   /**< (len1 + 1) x (len2 + 1) traceback matrix for batch alignment, one bit per lane and decision. */
+    std::vector<float> batchColumns;                /**< Interleaved MIDs aligned in batch, zero-padded to common length. */
+    std::vector<double> batchGapDown;               /**< Interleaved vertical gap penalties, zero at the last row of each lane. */
+};
+
+/**
+ * @brief The AlignmentTraceSink class receives the details of alignments done by MIDDistanceCalculator::traceMIDDistance(), e.g. for reports.
+ * Regular distance calculation never produces traces.
+ */
+class AlignmentTraceSink
+{
+public:
+    virtual ~AlignmentTraceSink() {}
+
+    /**
+     * @brief Called once per traced alignment.
+     * @param mid1 First MID (rows)
+     * @param mid2 Second MID (columns)
+     * @param ws Workspace holding the (mid1.size + 1) x (mid2.size + 1) score and traceback matrices and the aligned MIDs
+     * @param alignedSize Length of the aligned MIDs
+     * @param distance Normalized distance as returned by MIDDistanceCalculator::getMIDDistance()
+     */
+    virtual void trace(const MIDView &mid1, const MIDView &mid2, const NWWorkspace &ws, int alignedSize, double distance) = 0;
+};
 
 /**
  * @brief The MIDDistanceCalculator class does MID alignment and calculates the difference score.
+ * Configuration is fixed at construction (see MIDDistanceCalculator::Config), so one instance can be used from several threads.
  */
 class MIDDistanceCalculator
 {
@@ -45,6 +179,8 @@ public:
         D_MANHATTAN,
         D_COSINE,
         D_CUSTOM,
+        D_CI_WEIGHTED,  /**< Euclidean distance down-weighting wide confidence intervals (MIDView::ci). Needs the MIDs, not available for already aligned ones. */
+        D_EMD           /**< Earth mover's distance of the cumulative MIDs, without alignment, see getEMDDistance(). */
     };
 
     enum DISTANCE_NORMALIZATION{
@@ -55,37 +191,136 @@ public:
         DN_MIN
     };
 
-    static DISTANCE_MEASURE distanceMeasure;
-    static DISTANCE_NORMALIZATION distanceNormalization;
+    enum GAP_MODEL {
+        GM_FREE_END_GAPS,           /**< Tailing gaps are free, all other gaps cost the gap penalty. */
+        GM_CONSECUTIVE_GAP_DISCOUNT /**< All gaps cost the gap penalty, gaps following a gap only a tenth of it. */
+    };
+
+    /**
+     * @brief Immutable distance calculation settings. Use the with...() functions to derive modified copies.
+     */
+    class Config
+    {
+    public:
+        Config(double gapPenalty = NW_GAP_PENALTY, DISTANCE_MEASURE distanceMeasure = D_EUCLIDEAN, DISTANCE_NORMALIZATION distanceNormalization = DN_SUM,
+               int bandWidth = 0, bool adaptiveBand = false, GAP_MODEL gapModel = GM_FREE_END_GAPS)
+            : gapPenalty(gapPenalty), distanceMeasure(distanceMeasure), distanceNormalization(distanceNormalization),
+              bandWidth(bandWidth), adaptiveBand(adaptiveBand), gapModel(gapModel) {}
+
+        double getGapPenalty() const { return gapPenalty; }
+        DISTANCE_MEASURE getDistanceMeasure() const { return distanceMeasure; }
+        DISTANCE_NORMALIZATION getDistanceNormalization() const { return distanceNormalization; }
+        int getBandWidth() const { return bandWidth; }
+        bool isAdaptiveBand() const { return adaptiveBand; }
+        GAP_MODEL getGapModel() const { return gapModel; }
+
+        Config withGapPenalty(double gp) const { return Config(gp, distanceMeasure, distanceNormalization, bandWidth, adaptiveBand, gapModel); }
+        Config withDistanceMeasure(DISTANCE_MEASURE d) const { return Config(gapPenalty, d, distanceNormalization, bandWidth, adaptiveBand, gapModel); }
+        Config withDistanceNormalization(DISTANCE_NORMALIZATION dn) const { return Config(gapPenalty, distanceMeasure, dn, bandWidth, adaptiveBand, gapModel); }
+        Config withBand(int width, bool adaptive) const { return Config(gapPenalty, distanceMeasure, distanceNormalization, width, adaptive, gapModel); }
+        Config withGapModel(GAP_MODEL gm) const { return Config(gapPenalty, distanceMeasure, distanceNormalization, bandWidth, adaptiveBand, gm); }
+
+        bool operator==(const Config &other) const {
+            return gapPenalty == other.gapPenalty && distanceMeasure == other.distanceMeasure && distanceNormalization == other.distanceNormalization
+                    && bandWidth == other.bandWidth && adaptiveBand == other.adaptiveBand && gapModel == other.gapModel;
+        }
+        bool operator!=(const Config &other) const { return !(*this == other); }
+
+    private:
+        double gapPenalty;                              /**< Gap penalty for Needleman-Wunsch-alignment. */
+        DISTANCE_MEASURE distanceMeasure;               /**< Distance measure for aligned MIDs. */
+        DISTANCE_NORMALIZATION distanceNormalization;   /**< Normalization of distances by aligned MID length. */
+        int bandWidth;                                  /**< Band width for banded alignment of single pairs of long MIDs (see MIDDistanceCalculator::getBand()), 0 for full alignment. */
+        bool adaptiveBand;                              /**< Widen the band by the length difference of the MIDs? Otherwise the band is centered on the main diagonal. */
+        GAP_MODEL gapModel;                             /**< Gap costs; anything but GM_FREE_END_GAPS is aligned pairwise and unbanded. */
+    };
+
+    explicit MIDDistanceCalculator(const Config &config);
+    explicit MIDDistanceCalculator(double gapPenalty);
 
-    MIDDistanceCalculator(double gapPenalty);
+    const Config &getConfig() const;
 
-    void setDistanceMeasure(DISTANCE_MEASURE d);
+    static const int batchSize = 4; /**< Number of MIDs aligned simultaneously by getMIDDistances(). */
+    static const int maxFixedLength = LID_MAX_MASS_ISOTOPOMER + 1; /**< MIDs up to this length are aligned by the length-specialized kernels. */
 
-    double getMIDDistance(std::vector<double> mid1, std::vector<double> mid2);
-    static double getMIDDistance(std::vector<double> mid1, std::vector<double> mid2, double gapPenalty);
+    /** Length-specialized alignment and distance kernel, see getKernel(). */
+    typedef double (*NWKernel)(const MIDView &mid1, const MIDView &mid2, const Config &config);
 
-    static double getMIDDistance(const std::pair<std::vector<double>, std::vector<double> > &aligned, size_t origSize1 = 0, size_t origSize2 = 0);
+    double getMIDDistance(const MIDView &mid1, const MIDView &mid2) const;
+    double getMIDDistance(const MIDView &mid1, const MIDView &mid2, double abandonThreshold, AlignmentPath *path) const;
+    double getMIDDistance(const MIDView &mid1, const MIDView &mid2, const AlignmentPath &path) const;
+    bool supportsEarlyAbandon() const;
+    bool getBand(int len1, int len2, int &lo, int &hi) const;
+    double getEMDDistance(const MIDView &mid1, const MIDView &mid2) const;
+    double traceMIDDistance(const MIDView &mid1, const MIDView &mid2, AlignmentTraceSink &sink) const;
+
+    void getMIDDistances(const MIDView &mid1, const MIDView *mids2, int count, double *dists, double abandonThreshold = -1, AlignmentPath *paths = 0) const;
+    void getMIDDistances(const MIDView &mid1, const MIDView *mids2, int count, const double *gapPenalties, int numGapPenalties, double **dists) const;
+
+    double getMIDDistance(const std::pair<std::vector<double>, std::vector<double> > &aligned, size_t origSize1 = 0, size_t origSize2 = 0) const;
+    double getAlignedDistance(const double *alV1, const double *alV2, int alignedSize, size_t origSize1 = 0, size_t origSize2 = 0) const;
+    double getDistanceLowerBound(const MIDView &mid1, const MIDView &mid2) const;
+    double getDistanceLowerBound(const MIDSums &sums1, const MIDSums &sums2) const;
 
     // z-score functions need checking!
-    static std::pair<double,double> createMonteCarloModel(int len1, int len2, int size = MCMsize);
-    static double getMonteCarloZScore(double distance, int size1, int size2);
+    std::pair<double,double> createMonteCarloModel(int len1, int len2, int size = MCMsize) const;
+    double getMonteCarloZScore(double distance, int size1, int size2) const;
 
     static void normalize(std::vector<double>::iterator itBegin, std::vector<double>::iterator itEnd, double sum = 1);
     static double sum(std::vector<double>::iterator itBegin, std::vector<double>::iterator itEnd);
     static std::vector<double> getNormalizedRandomVector(int size, int sum = 1);
+    static void getNormalizedRandomVector(std::vector<double> &v, int sum = 1);
 
     // Needleman-Wunsch
-    template<class T> static std::pair<std::vector<T>, std::vector<T> > nw(std::vector<T> v1, std::vector<T> v2, double gapPenalty);
-    std::pair<std::vector<double>, std::vector<double> > nw(std::vector<double> v1, std::vector<double> v2);
+    static int align(const MIDView &v1, const MIDView &v2, double gapPenalty, NWWorkspace &ws);
+    static std::pair<std::vector<double>, std::vector<double> > nw(const MIDView &v1, const MIDView &v2, double gapPenalty);
+    std::pair<std::vector<double>, std::vector<double> > nw(const MIDView &v1, const MIDView &v2) const;
+
+    static NWWorkspace &workspace();
+    static NWKernel getKernel(int len1, int len2);
 
-    template<class T> static void initNWMatrices(int size1, int size2, double gapPenalty, std::vector<std::vector<T> > &scoreMat, std::vector<std::vector<char> > &tracebackMat);
     template<class T> static void printAlignedVectors(std::vector<T> const &v1, std::vector<T> const &v2);
 
 private:
+    MIDDistanceCalculator(const MIDDistanceCalculator &);
+    MIDDistanceCalculator &operator=(const MIDDistanceCalculator &);
+
+    /** All-pairs drivers, instantiated per distance measure and normalization, see selectDrivers(). */
+    typedef void (MIDDistanceCalculator::*BatchDriver)(const MIDView &mid1, const MIDView *mids2, int count, double *dists, AlignmentPath *paths) const;
+    typedef void (*SweepDriver)(const MIDView &mid1, const MIDView *mids2, int count, const double *gapPenalties, int numGapPenalties, double **dists);
+    typedef double (*PathDriver)(const MIDView &mid1, const MIDView &mid2, const AlignmentPath &path);
+
+    void selectDrivers();
+    template<class Measure> void selectDrivers();
+    template<class Measure, class Normalization> void setDrivers();
+    template<class Measure, class Normalization> void getMIDDistancesBatch(const MIDView &mid1, const MIDView *mids2, int count, double *dists, AlignmentPath *paths) const;
+    template<class Measure, class Normalization> static void getMIDDistancesSweep(const MIDView &mid1, const MIDView *mids2, int count, const double *gapPenalties, int numGapPenalties, double **dists);
+    template<class Measure, class Normalization> static double getMIDDistancePath(const MIDView &mid1, const MIDView &mid2, const AlignmentPath &path);
+
+    static void fillNWMatrices(const MIDView &v1, const MIDView &v2, double gapPenalty, NWWorkspace &ws);
+    static void fillNWMatricesConsecutiveGapDiscount(const MIDView &v1, const MIDView &v2, double gapPenalty, NWWorkspace &ws);
+    static bool fillNWMatricesBanded(const MIDView &v1, const MIDView &v2, double gapPenalty, int lo, int hi, NWWorkspace &ws);
+    void fillNWMatrices(const MIDView &v1, const MIDView &v2, NWWorkspace &ws) const;
+    static int traceback(const MIDView &v1, const MIDView &v2, NWWorkspace &ws);
+    template<class Measure> static bool fillNWMatricesAbandon(const MIDView &v1, const MIDView &v2, double gapPenalty, double limit, NWWorkspace &ws);
+    static void fillNWMatricesBatch(const MIDView &v1, const MIDView *v2, const double *gapPenalties, int count, NWWorkspace &ws);
+    template<class Traceback> static double scoreTraceback(const MIDView &v1, const MIDView &v2, const Traceback &tb, const Config &config);
+    template<class Traceback> static double scoreTraceback(const MIDView &v1, const MIDView &v2, const Traceback &tb, const Config &config, AlignmentPath *path);
+    template<class Measure, class Traceback> static double scoreTracebackWith(const MIDView &v1, const MIDView &v2, const Traceback &tb, const Config &config);
+    template<class Measure, class Normalization, class Traceback> static double accumulateDistance(const MIDView &v1, const MIDView &v2, const Traceback &tb);
+    static double normalizeDistance(double dist, int alignedSize, size_t origSize1, size_t origSize2, const Config &config);
+    static double getNormalizationDivisor(int alignedSize, size_t origSize1, size_t origSize2, const Config &config);
+    static double getMIDDistanceWorkspace(const MIDView &mid1, const MIDView &mid2, const Config &config);
+    template<int LEN2> static double getMIDDistanceFixed(const MIDView &mid1, const MIDView &mid2, const Config &config);
+    template<int LEN2> friend struct NWKernelTableFiller;
+
     static const int MCMsize = 1000; /**< Number of MID pairs to generate. */
-    static double gapPenalty; /**< Gap penalty for Needleman-Wunsch-alignment. */
-    static std::map<std::pair<int, int>, std::pair<double, double> > MCModels; /**< Monte-Carlo models by MID size. (size1, size2) -> (mean, standard deviation); size1 <= size2. */
+    const Config config; /**< Gap penalty, distance measure and normalization. */
+    BatchDriver batchDriver; /**< getMIDDistancesBatch() for the configured measure and normalization. */
+    SweepDriver sweepDriver; /**< getMIDDistancesSweep() for the configured measure and normalization. */
+    PathDriver pathDriver;   /**< getMIDDistancePath() for the configured measure and normalization. */
+    mutable std::map<std::pair<int, int>, std::pair<double, double> > MCModels; /**< Monte-Carlo models by MID size. (size1, size2) -> (mean, standard deviation); size1 <= size2. */
+    mutable QMutex MCModelsMutex; /**< Guards MCModels, which is filled lazily. */
 };
 
 /**
@@ -96,18 +331,17 @@ class MonteCarloHelper : public QThread {
     Q_OBJECT
 
 public:
-    MonteCarloHelper(double *arr, int number, int len1, int len2, double gapPenalty)
-        : arr(arr), number(number), len1(len1), len2(len2), gapPenalty(gapPenalty) {}
+    MonteCarloHelper(double *arr, int number, int len1, int len2, const MIDDistanceCalculator *distCalc)
+        : arr(arr), number(number), len1(len1), len2(len2), distCalc(distCalc) {}
 
 private:
     void run();
 
-    MIDDistanceCalculator *parent; /**< The instanciating object. */
     double *arr;        /**< Pointer to double array to put the @b number MIDs into. */
     int number;         /**< Number of MID pairs to generate. */
     int len1;           /**< Length of first MID vector. */
     int len2;           /**< Length of second MID vector. */
-    double gapPenalty;  /**< Gap penalty for Needleman-Wunsch-alignment. */
+    const MIDDistanceCalculator *distCalc; /**< Calculator to align with, so the model matches its distance measure, gap model and band. */
 };
 
 }
@@ -49,8 +49,12 @@ std::vector<gcms::Compound<int, float>* > compoundsFromFiles(std::vector<std::st
 
 double getEuclideanDistance(const std::vector<double> &v, const std::vector<double> &w) {
     assert(v.size() == w.size());
+    return getEuclideanDistance(v.data(), w.data(), v.size());
+}
+
+double getEuclideanDistance(const double *v, const double *w, int size) {
     double d = 0; // distance
-    for(int i = 0; i < v.size(); ++i) {
+    for(int i = 0; i < size; ++i) {
         d += (v[i] - w[i]) * (v[i] - w[i]);
     }
     return sqrt(d);
@@ -145,18 +149,6 @@ void matToCsv(const std::vector<std::vector<double> > &mat, std::string fname, s
     ofs.close();
 }
 
-/**
- * @brief (Dis-)similarity score for two mass-isotopomer abundances used for Needleman-Wunsch-scoring.
- *
- * @param v1 Value 1
- * @param v2 Value 2
- * @return float The score
- */
-float nwScoreMID(float v1, float v2) {
-    return std::fabs(v1 - v2);
-}
-
-
 /**
  * @brief Output matrix to ostream
  *
@@ -196,8 +188,13 @@ void printMat(const std::vector<std::vector<bool> > &mat, std::ostream &os) {
 double getCosineCorrelation(const std::vector<double> &v, const std::vector<double> &w)
 {
     assert(v.size() == w.size());
+    return getCosineCorrelation(v.data(), w.data(), v.size());
+}
+
+double getCosineCorrelation(const double *v, const double *w, int size)
+{
     double dot = 0;
-    for(int i = 0; i < v.size(); ++i)
+    for(int i = 0; i < size; ++i)
         dot += v[i] * w[i];
     return dot;
 }
@@ -206,8 +203,13 @@ double getCosineCorrelation(const std::vector<double> &v, const std::vector<doub
 double getCanberraDistance(const std::vector<double> &v, const std::vector<double> &w)
 {
     assert(v.size() == w.size());
+    return getCanberraDistance(v.data(), w.data(), v.size());
+}
+
+double getCanberraDistance(const double *v, const double *w, int size)
+{
     double d = 0; // distance
-    for(int i = 0; i < v.size(); ++i) {
+    for(int i = 0; i < size; ++i) {
         d += fabs(v[i] - w[i]) / (fabs(v[i]) + fabs(w[i]));
     }
     return d;
@@ -217,17 +219,27 @@ double getCanberraDistance(const std::vector<double> &v, const std::vector<doubl
 double getManhattanDistance(const std::vector<double> &v, const std::vector<double> &w)
 {
     assert(v.size() == w.size());
+    return getManhattanDistance(v.data(), w.data(), v.size());
+}
+
+double getManhattanDistance(const double *v, const double *w, int size)
+{
     double d = 0; // distance
-    for(int i = 0; i < v.size(); ++i) {
+    for(int i = 0; i < size; ++i) {
         d += fabs(v[i] - w[i]);
     }
     return d;
 }
 
 
-double getCustomDistance(const std::vector<double> &v, const std::vector<double> &w, const std::vector<double> &vCI, const std::vector<double> &wCI)
+double getCustomDistance(const std::vector<double> &v, const std::vector<double> &w)
 {
     assert(v.size() == w.size());
+    return getCustomDistance(v.data(), w.data(), v.size());
+}
+
+double getCustomDistance(const double *v, const double *w, int size)
+{
     double d = 0; // distance
  /*
     for(int i = 0; i < v.size(); ++i) {
@@ -262,27 +274,91 @@ double getCustomDistance(const std::vector<double> &v, const std::vector<double>
     // pearson:
     // means
     double m_v = 0, m_w = 0;
-    for(int i = 0; i < v.size(); ++i) {
+    for(int i = 0; i < size; ++i) {
         m_v += v[i];
         m_w += w[i];
     }
-    m_v /= v.size();
-    m_w /= w.size();
+    m_v /= size;
+    m_w /= size;
     // sds
     double sd_v = 0, sd_w = 0;
-    for(int i = 0; i < v.size(); ++i) {
+    for(int i = 0; i < size; ++i) {
         sd_v += (m_v - v[i]) * (m_v - v[i]);
         sd_w += (m_w - w[i]) * (m_w - w[i]);
     }
-    sd_v = sqrt(sd_v / v.size());
-    sd_w = sqrt(sd_w / w.size());
+    sd_v = sqrt(sd_v / size);
+    sd_w = sqrt(sd_w / size);
 
-    for(int i = 0; i < v.size(); ++i) {
+    for(int i = 0; i < size; ++i) {
         d += (v[i] - m_v ) / sd_v * (w[i] - m_w ) / sd_w;
     }
 
-    d = 1 - d / v.size();
+    d = 1 - d / size;
+
+    return d;
+}
+
+
+double getCIWeightedDistance(const std::vector<double> &v, const std::vector<double> &w, const std::vector<double> &vCI, const std::vector<double> &wCI)
+{
+    assert(v.size() == w.size());
+    return getCIWeightedDistance(v.data(), w.data(), vCI.size() ? vCI.data() : 0, wCI.size() ? wCI.data() : 0, v.size());
+}
+
+/**
+ * @brief Euclidean distance with each squared difference weighted by (|v| + |w|) / (|v| + |w| + vCI + wCI),
+ * i.e. down-weighting abundances with wide confidence intervals relative to the abundances themselves.
+ * The weights do not change if abundances and confidence intervals are scaled alike.
+ *
+ * @param v     First vector
+ * @param w     Second vector
+ * @param vCI   Confidence intervals of @p v, or 0 for exact values
+ * @param wCI   Confidence intervals of @p w, or 0 for exact values
+ * @param size  Length of the vectors
+ */
+double getCIWeightedDistance(const double *v, const double *w, const double *vCI, const double *wCI, int size)
+{
+    double d = 0; // distance
+    for(int i = 0; i < size; ++i) {
+        double s = fabs(v[i]) + fabs(w[i]);
+        double c = (vCI ? vCI[i] : 0) + (wCI ? wCI[i] : 0);
+        if(s + c > 0)
+            d += (v[i] - w[i]) * (v[i] - w[i]) * s / (s + c);
+    }
+    return sqrt(d);
+}
+
+double getEarthMoversDistance(const std::vector<double> &v, const std::vector<double> &w)
+{
+    return getEarthMoversDistance(v.data(), v.size(), w.data(), w.size());
+}
 
+/**
+ * @brief Earth mover's distance of two distributions over the mass isotopomers, i.e. the Manhattan distance of
+ * their cumulative sums. The shorter vector is padded with zeros, no alignment is needed.
+ *
+ * @param v     First vector
+ * @param size1 Length of @p v
+ * @param w     Second vector
+ * @param size2 Length of @p w
+ */
+double getEarthMoversDistance(const double *v, int size1, const double *w, int size2)
+{
+    const int common = std::min(size1, size2);
+    double c = 0; // difference of cumulative sums
+    double d = 0; // distance
+    for(int i = 0; i < common; ++i) {
+        c += v[i] - w[i];
+        d += fabs(c);
+    }
+    for(int i = common; i < size1; ++i) {
+        c += v[i];
+        d += fabs(c);
+    }
+    for(int i = common; i < size2; ++i) {
+        c -= w[i];
+        d += fabs(c);
+    }
     return d;
 }
 
@@ -290,33 +366,57 @@ double getCustomDistance(const std::vector<double> &v, const std::vector<double>
 std::vector<double> basePeakNormalization(const std::vector<double> &v)
 {
     std::vector<double> res(v.size());
-    if(v.size()) {
+    basePeakNormalization(v.data(), v.size(), res.data());
+    return res;
+}
+
+/**
+ * @brief Base peak normalization without allocation. @p res may also be @p v - 1 (normalize and shift in place).
+ *
+ * @param v     Abundances
+ * @param size  Number of abundances
+ * @param res   Output array for @p size normalized abundances
+ */
+void basePeakNormalization(const double *v, int size, double *res)
+{
+    if(size) {
         // find max
         double max = v[0];
-        for(int i = 0; i < v.size(); ++i) {
+        for(int i = 0; i < size; ++i) {
             max = std::max(max, v[i]);
         }
         // normalize
-        for(int i = 0; i < v.size(); ++i) {
+        for(int i = 0; i < size; ++i) {
             res[i] = v[i] / max;
         }
     }
-    return res;
 }
 
 std::vector<double> sumNormalization(const std::vector<double> &v)
 {
     std::vector<double> res(v.size());
-    if(v.size()) {
+    sumNormalization(v.data(), v.size(), res.data());
+    return res;
+}
+
+/**
+ * @brief Sum normalization without allocation. @p res may also be @p v - 1 (normalize and shift in place).
+ *
+ * @param v     Abundances
+ * @param size  Number of abundances
+ * @param res   Output array for @p size normalized abundances
+ */
+void sumNormalization(const double *v, int size, double *res)
+{
+    if(size) {
         // find sum
         double sum = 0;
-        for(int i = 0; i < v.size(); ++i) {
+        for(int i = 0; i < size; ++i) {
             sum += v[i];
         }
         // normalize
-        for(int i = 0; i < v.size(); ++i) {
+        for(int i = 0; i < size; ++i) {
             res[i] = v[i] / sum;
         }
     }
-    return res;
 }
@@ -42,15 +42,26 @@ gcms::LibrarySearch<int, float> *libraryFromCompoundFiles(std::vector<std::strin
 
 std::vector<gcms::LibraryCompound<int, float>* > libraryCompoundsFromFiles(std::vector<std::string> files);
 
-//double getCustomDistance(const std::vector<double> &v, const std::vector<double> &w);
-double getCustomDistance(const std::vector<double> &v, const std::vector<double> &w, const std::vector<double> &vCI = std::vector<double>(), const std::vector<double> &wCI = std::vector<double>());
+double getCustomDistance(const std::vector<double> &v, const std::vector<double> &w);
 double getCanberraDistance(const std::vector<double> &v, const std::vector<double> &w);
 double getManhattanDistance(const std::vector<double> &v, const std::vector<double> &w);
 double getEuclideanDistance(const std::vector<double> &v, const std::vector<double> &w);
 double getCosineCorrelation(const std::vector<double> &v, const std::vector<double> &w);
+double getCIWeightedDistance(const std::vector<double> &v, const std::vector<double> &w, const std::vector<double> &vCI, const std::vector<double> &wCI);
+double getEarthMoversDistance(const std::vector<double> &v, const std::vector<double> &w);
+
+double getCustomDistance(const double *v, const double *w, int size);
+double getCanberraDistance(const double *v, const double *w, int size);
+double getManhattanDistance(const double *v, const double *w, int size);
+double getEuclideanDistance(const double *v, const double *w, int size);
+double getCosineCorrelation(const double *v, const double *w, int size);
+double getCIWeightedDistance(const double *v, const double *w, const double *vCI, const double *wCI, int size);
+double getEarthMoversDistance(const double *v, int size1, const double *w, int size2);
 
 std::vector<double> basePeakNormalization(std::vector<double> const &v);
 std::vector<double> sumNormalization(std::vector<double> const &v);
+void basePeakNormalization(const double *v, int size, double *res);
+void sumNormalization(const double *v, int size, double *res);
 
 template <class T> void printVec(std::vector<T> v, std::ostream &os = std::cerr) {
     os<<v.size()<<" elements: ";
@@ -143,7 +154,9 @@ template<class T> T min(T v1, T v2, T v3) {
  * @param v2 Value 2
  * @return float The score
  */
-float nwScoreMID(float v1, float v2);
+inline float nwScoreMID(float v1, float v2) {
+    return std::fabs(v1 - v2);
+}
 
 /**
  * @brief Output matrix to ostream
@@ -154,265 +167,4 @@ float nwScoreMID(float v1, float v2);
 void printMat(const std::vector<std::vector<double> > &mat, std::ostream &os = std::cerr);
 void printMat(const std::vector<std::vector<char> > &mat, std::ostream &os = std::cerr);
 
-/**
- * @brief Print aligned sequences.
- *
- * @param mat Needleman-Wunsch-matrix
- * @param v1 Sequence 1
- * @param v2 Sequence 1
- */
-template<class T>
-void printAlign(const std::vector<std::vector<double> > mat, std::vector<T> v1, std::vector<T> v2) {
-    // retrace best alignment, start at bottom right
-    std::vector<double> alV1, alV2;
-    int i = v1.size(); // matrix is v1.size + 1
-    int j = v2.size();
-    int gaps = 0;
-    while(i > 0 || j > 0) { // i: row, v1 ; j: col, v2
-            double sright, sdown, sdiag; // scores (go left, right, diag)
-            sright = j > 0?mat[i][j - 1]:1000; // if border set 1000: hilariously big score, cant go this way
-            sdown = i > 0?mat[i - 1][j]:1000;
-            sdiag = i*j > 0?mat[i - 1][j - 1]:1000;
-            double mn = min<double>(sright, sdown, sdiag);
-            if(mn == sdiag) {
-                alV1.push_back(v1[--i]);
-                alV2.push_back(v2[--j]);
-            } else if (mn == sdown) {
-                alV1.push_back(v1[--i]);
-                alV2.push_back(0);
-                ++gaps;
-            } else if (mn == sright) {
-                alV1.push_back(0);
-                alV2.push_back(v2[--j]);
-                ++gaps;
-            } else {
-                std::cerr<<"severe nw() problem";
-            }
-    }
-
-    // output in reverse
-    std::stringstream al;
-    al << std::setw(6) << std::setprecision(2) << std::resetiosflags(std::ios::right);
-    std::vector<double>::reverse_iterator it = alV1.rbegin();
-    while(it < alV1.rend()) al << *(it++) << "\t\t";
-    al << std::endl;
-    it = alV2.rbegin();
-    while(it < alV2.rend()) al << *(it++) << "\t\t";
-    al << std::endl;
-    std::cerr<<al.str();
-}
-
-/**
- * @brief Print aligned sequences.
- *
- * @param mat Needleman-Wunsch-matrix
- * @param v1 Sequence 1
- * @param v2 Sequence 1
- */
-template<class T>
-void printAlignHTML(const std::vector<std::vector<double> > mat, std::vector<T> v1, std::vector<T> v2, std::ofstream &ofs) {
-    // retrace best alignment, start at bottom right
-    std::vector<double> alV1, alV2;
-    int i = v1.size(); // matrix is v1.size + 1
-    int j = v2.size();
-    int gaps = 0;
-    while(i > 0 || j > 0) { // i: row, v1 ; j: col, v2
-            double sright, sdown, sdiag; // scores (go left, right, diag)
-            sright = j > 0?mat[i][j - 1]:1000; // if border set 1000: hilariously big score, cant go this way
-            sdown = i > 0?mat[i - 1][j]:1000;
-            sdiag = i*j > 0?mat[i - 1][j - 1]:1000;
-            double mn = min<double>(sright, sdown, sdiag);
-            if(mn == sdiag) {
-                alV1.push_back(v1[--i]);
-                alV2.push_back(v2[--j]);
-            } else if (mn == sdown) {
-                alV1.push_back(v1[--i]);
-                alV2.push_back(-999);
-                ++gaps;
-            } else if (mn == sright) {
-                alV1.push_back(-999);
-                alV2.push_back(v2[--j]);
-                ++gaps;
-            } else {
-                std::cerr<<"prob printAlignHTML";
-            }
-    }
-
-    // output in reverse
-    ofs <<"<br><table border=1><tr>";
-    ofs << std::setw(6) << std::setprecision(4) << std::resetiosflags(std::ios::right);
-    std::vector<double>::reverse_iterator it = alV1.rbegin();
-    while(it < alV1.rend()) ofs << "<td>"<<*(it++) << "</td>";
-    ofs << "</tr><tr>"<<std::endl;
-    it = alV2.rbegin();
-    while(it < alV2.rend()) ofs << "<td>"<<*(it++) << "</td>";
-    ofs <<"</table>"<<std::endl;
-    ofs <<"Introduced "<<gaps<<" gaps";
-
-}
-
-/**
- * @brief Generic Needleman&Wunsch sequence alignment algorithm (Needleman, S. B. & Wunsch, C. D. A general method applicable to the search for similarities in the amino acid sequence of two proteins. J Mol Biol, 1970, 48, 443-453)
- *
- * @param v1 Sequence 1
- * @param v2 Sequence 1
- * @param gapPenalty Penalty for gap insertion
- * @return T Score for best alignment, normalized by sequence length
- */
-template<class T> T nw(std::vector<T> v1, std::vector<T> v2, double gapPenalty) {
-    //         j  0     1     2     3    4
-    //    i       0   V2[0] V2[1] V2[2] V2[3]
-    //    0  0    0    gp   2gp    3gp  4gp
-    //    1 V1[0] gp
-    //    2 V1[1] 2gp
-    //    3 V1[2] 3gp
-
-    // the lower the score the better
-    std::vector<std::vector<double> > mat;
-
-    // resize, fill left and top with gap penalty
-    mat.resize(v1.size() + 1); // need 0
-    for(int i = 0; i <= v1.size(); ++i) {
-        mat[i].resize(v2.size() + 1);
-        mat[i][0] = gapPenalty * i;
-    }
-    for(int j = 1; j <= v2.size(); ++j) {
-        mat[0][j] = gapPenalty * j;
-    }
-
-    double curGapPenalty = gapPenalty;
-
-    // do actual stuff
-    for(int i = 1; i <= v1.size(); ++i) { // row
-        for(int j = 1; j <= v2.size(); ++j) { // col
-            double sright, sdown, sdiag; // scores
-
-            // had gap before? make consecutive gaps less expensive
-            if((j > 1 && mat[i][j-2] < mat[i-1][j-1]) || (mat[i-1][j-1] < mat[i-1][j-1])) curGapPenalty = gapPenalty / 10;
-            else curGapPenalty = gapPenalty;
-            // go right?
-            sright = mat[i][j - 1] + curGapPenalty;
-
-            // had gap before? make consecutive gaps less expensive
-            if((mat[i-1][j-1] < mat[i-1][j-1]) || (i > 1 && mat[i-2][j-1] < mat[i-1][j-1])) curGapPenalty = gapPenalty / 10;
-            else curGapPenalty = gapPenalty;
-            // go down?
-            sdown = mat[i - 1][j] + curGapPenalty;
-
-            // go diagonal?
-            sdiag = mat[i - 1][j - 1] + nwScoreMID(v1[i - 1], v2[j - 1]); // + 1 because of initial 0 in matrix
-            mat[i][j] = min<double>(sright, sdown, sdiag);
-
-            // remember last action
-        }
-    }
-
-#if MISC_H_DEBUG > 1
-    // Debug
-    std::cerr<<"vecs"<<std::endl;
-    std::vector<double>::const_iterator it = v1.begin();//template??
-    std::cerr<<v1.size()<<": ";
-    while(it < v1.end()) std::cerr<<*(it++)<<"\t\t";
-    std::cerr<<std::endl;
-    it = v2.begin();
-    std::cerr<<v2.size()<<": ";
-    while(it < v2.end()) std::cerr<<*(it++)<<"\t\t";
-    std::cerr<<std::endl;
-    std::cerr<<"mat"<<std::endl;
-    printMat(mat);
-    std::cerr<<"al"<<std::endl;
-    printAlign(mat, v1, v2);
-#endif //MISC_H_DEBUG
-std::cerr<<std::endl;printAlign(mat, v1, v2);std::cerr<<std::endl;
-    // retrace best alignment, start at bottom right
-    std::vector<double> alV1, alV2;
-    int i = v1.size(); // matrix is v1.size + 1
-    int j = v2.size();
-    int gaps = 0;
-    while(i > 0 || j > 0) { // i: row, v1 ; j: col, v2
-            double sright, sdown, sdiag; // scores (go left, right, diag)
-            sright = j > 0?mat[i][j - 1]:1000; // if border set 1000: hilariously big score, cant go this way
-            sdown = i > 0?mat[i - 1][j]:1000;
-            sdiag = i*j > 0?mat[i - 1][j - 1]:1000;
-            double mn = min<double>(sright, sdown, sdiag);
-            if(mn == sdiag) {
-                alV1.push_back(v1[--i]);
-                alV2.push_back(v2[--j]);
-            } else if (mn == sdown) {
-                alV1.push_back(v1[--i]);
-                alV2.push_back(0);
-                ++gaps;
-            } else if (mn == sright) {
-                alV1.push_back(0);
-                alV2.push_back(v2[--j]);
-                ++gaps;
-            } else {
-                std::cerr<<"severe nw() problem";
-            }
-    }
-    //return getEuclideanDistance(alV1, alV2);
-    return getCosineCorrelation(alV1, alV2) / (alV1.size() * alV2.size());
-//    return mat[v1.size()][v2.size()] / std::max(v1.size(), v2.size());
-}
-
-
-template<class T> T nwHTML(std::vector<T> v1, std::vector<T> v2, double gapPenalty, std::ofstream &ofs) {
-    // the lower the score the better
-    std::vector<std::vector<double> > mat;
-
-    // resize, fill left and top with gap penalty
-    mat.resize(v1.size() + 1); // need 0
-    for(int i = 0; i <= v1.size(); ++i) {
-        mat[i].resize(v2.size() + 1);
-        mat[i][0] = gapPenalty * i;
-    }
-    for(int j = 1; j <= v2.size(); ++j) {
-        mat[0][j] = gapPenalty * j;
-    }
-
-
-    // v2 header
-    ofs<<"<table border=1><tr><td></td><td><b>0</b></td>"<<std::endl;
-    std::vector<double>::const_iterator it = v2.begin();
-    while(it < v2.end()) ofs<<"<td><b>"<<*(it++)<<"</b></td>";
-    ofs<<"</tr>"<<std::endl;
-
-    double curGapPenalty = gapPenalty;
-
-    // do actual stuff
-    for(int i = 0; i <= v1.size(); ++i) { // row
-        ofs<<"<tr><td><b>"<<(i==0?0:v1[i - 1])<<"</b></td>";
-        for(int j = 0; j <= v2.size(); ++j) { // col
-            if(i*j > 0) { // i,j== 0; only for printing
-
-            double sright, sdown, sdiag; // scores
-
-            // had gap before? make consecutive gaps less expensive
-            if((j > 1 && mat[i][j-2] < mat[i-1][j-1]) || (mat[i-1][j-1] < mat[i-1][j-1])) curGapPenalty = gapPenalty / 10;
-            else curGapPenalty = gapPenalty;
-            // go right?
-            sright = mat[i][j - 1] + curGapPenalty;
-
-            // had gap before? make consecutive gaps less expensive
-            if((mat[i-1][j-1] < mat[i-1][j-1]) || (i > 1 && mat[i-2][j-1] < mat[i-1][j-1])) curGapPenalty = gapPenalty / 10;
-            else curGapPenalty = gapPenalty;
-            // go down?
-            sdown = mat[i - 1][j] + curGapPenalty;
-
-            // go diagonal?
-            sdiag = mat[i - 1][j - 1] + nwScoreMID(v1[i - 1], v2[j - 1]); // - 1 because of initial 0 in matrix
-            mat[i][j] = min<double>(sright, sdown, sdiag);
-
-            }
-            ofs<<"<td>"<<mat[i][j]<<"</td>";
-        }
-        ofs << "</tr>\n";
-    }
-    ofs<<"</table>\n";
-
-    printAlignHTML(mat, v1, v2, ofs);
-    // use bottom right as similarity score; normalize by mid length
-    //return mat[v1.size() - 1][v2.size() - 1] / std::max(v1.size(), v2.size());
-    return mat[v1.size()][v2.size()];
-}
 #endif // MISC_H
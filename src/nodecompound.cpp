@@ -39,6 +39,8 @@ NodeCompound::NodeCompound()
 
     largestCommonIon = -1;
     selectedIon = -1;
+    useLargestCommonIon = NW_USE_LARGEST_COMMON_ION;
+    selectionChanged = true;
 }
 
 NodeCompound::NodeCompound(std::string name)
@@ -48,6 +50,8 @@ NodeCompound::NodeCompound(std::string name)
 
     largestCommonIon = -1;
     selectedIon = -1;
+    useLargestCommonIon = NW_USE_LARGEST_COMMON_ION;
+    selectionChanged = true;
 }
 
 void NodeCompound::addLabeledCompound(std::string experiment, labid::LabeledCompound *lc)
@@ -66,6 +70,7 @@ void NodeCompound::addLabeledCompound(std::string experiment, labid::LabeledComp
     maxSD = -1;
     largestCommonIon = -1;
     selectedIon = -1;
+    selectionChanged = true;
 }
 
 labid::LabeledCompound *NodeCompound::getLabeledCompound(std::string experiment)
@@ -89,6 +94,7 @@ void NodeCompound::removeLabeledCompound(labid::LabeledCompound *lc)
     maxSD = -1;
     largestCommonIon = -1;
     selectedIon = -1;
+    selectionChanged = true;
 }
 
 void NodeCompound::addUnlabeledCompound(std::string experiment, labid::LISpectrum *ls)
@@ -149,6 +155,30 @@ double NodeCompound::getSelectedR2(std::string t)
 //    return lc->getR2s().at(lc->getLargestSignificantIonIndex(0.95));
 }
 
+/**
+ * @brief MIDs of all labeled ions in the given experiment, in the order of LabeledCompound::getLabeledIons
+ */
+std::vector<std::vector<double> > NodeCompound::getMIDs(std::string t)
+{
+    return getCompound(t)->getIsotopomers();
+}
+
+/**
+ * @brief Confidence intervals of the MIDs of all labeled ions in the given experiment, see getMIDs
+ */
+std::vector<std::vector<double> > NodeCompound::getCIs(std::string t)
+{
+    return getCompound(t)->getConfidenceIntervals();
+}
+
+/**
+ * @brief R2 of the MIDs of all labeled ions in the given experiment, see getMIDs
+ */
+std::vector<double> NodeCompound::getR2s(std::string t)
+{
+    return getCompound(t)->getR2s();
+}
+
 /**
  * @brief NodeCompound::getLargestCommonIon
  * @return highest common m/z
@@ -543,6 +573,7 @@ void NodeCompound::redetectFragments()
         (*it)->setFeatures(lc.getFeatures());
     }
 
+    selectionChanged = true;
 }
 
 labid::LabeledCompound* NodeCompound::detectFragments(labid::LISpectrum &ul_comp, labid::LISpectrum &l_comp, const std::list<std::pair<size_t, size_t> > &fragments)
@@ -753,11 +784,26 @@ bool NodeCompound::getUseLargestCommonIon() const
 
 void NodeCompound::setUseLargestCommonIon(bool value)
 {
+    if(value != useLargestCommonIon)
+        selectionChanged = true;
     useLargestCommonIon = value;
 
     selectedIon = -1;
 }
 
+/**
+ * @brief Whether the selected ion or the MIDs may have changed since the last call to clearSelectionChanged(). True for new compounds.
+ */
+bool NodeCompound::isSelectionChanged() const
+{
+    return selectionChanged;
+}
+
+void NodeCompound::clearSelectionChanged()
+{
+    selectionChanged = false;
+}
+
 QDataStream &operator <<(QDataStream &out, const NodeCompound &nc)
 {
     out<<QString("NodeCompound");
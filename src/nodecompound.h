@@ -58,6 +58,9 @@ public:
     double getSelectedIon(std::string t);
     const std::vector<double> getSelectedCI(std::string t);
     double getSelectedR2(std::string t);
+    std::vector<std::vector<double> > getMIDs(std::string t);
+    std::vector<std::vector<double> > getCIs(std::string t);
+    std::vector<double> getR2s(std::string t);
     float getLargestCommonIon();
     int getSelectedIndex(std::string t);
     int getMMinusNIon(std::string t, int loss);
@@ -95,10 +98,14 @@ public:
     bool getUseLargestCommonIon() const;
     void setUseLargestCommonIon(bool value);
 
+    bool isSelectionChanged() const;
+    void clearSelectionChanged();
+
 private:
     float largestCommonIon;
     int selectedIon;
     bool useLargestCommonIon;
+    bool selectionChanged;              /**< Whether selected ion or MIDs may have changed, see isSelectionChanged(). */
     double maxSD;
     QString compoundName;               /**< Compound label. */
     QList<QString> experimentsLab;      /**< List of the tracers/conditions in which this compound was identified as labeled. */
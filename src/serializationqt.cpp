@@ -336,7 +336,7 @@ QDataStream &operator >>(QDataStream &in, gcms::LibraryCompound<int, float> *c)
 
 QDataStream &operator <<(QDataStream &out, const mia::Settings s)
 {
-    out<<QString("Settings");
+    out<<QString("SettingsV")<<(quint32)SERIALIZATIONQT_H_SETTINGS_VERSION;
 
     out << QString::fromStdString(s.experiment) << s.cmp_id_use_ri << s.cmp_id_ri_tol << s.cmp_id_score_cutoff
         << s.labels_max_hits << s.gcms_pure_factor << s.gcms_impure_factor
@@ -347,6 +347,8 @@ QDataStream &operator <<(QDataStream &out, const mia::Settings s)
         << s.lid_req_r2 << s.lid_min_frag_num << s.lid_sensitivity << s.lid_maximal_frag_dev
         << s.lid_correction_ratio << s.nw_gap_penalty<< s.nw_exclude_m0
         << s.mid_distance_cutoff;
+    // version 2
+    out << QVector<double>::fromStdVector(s.nw_gap_penalty_sweep) << (qint32)s.nw_band_width << s.nw_band_adaptive;
     return out;
 }
 
@@ -354,8 +356,13 @@ QDataStream &operator >>(QDataStream &in, mia::Settings &s) throw(Deserializatio
 {
     QString magic;
     in >> magic;
-    if(magic != "Settings")
+    quint32 version = 1;
+    if(magic == "SettingsV")
+        in >> version;
+    else if(magic != "Settings")
         throw(DeserializationException("Settings -- Settings"));
+    if(version > SERIALIZATIONQT_H_SETTINGS_VERSION)
+        throw(DeserializationException("Settings -- version"));
 
     QString t, lib;
     in >> t >> s.cmp_id_use_ri >> s.cmp_id_ri_tol >> s.cmp_id_score_cutoff;
@@ -369,6 +376,13 @@ QDataStream &operator >>(QDataStream &in, mia::Settings &s) throw(Deserializatio
        >> s.lid_req_r2 >> s.lid_min_frag_num >> s.lid_sensitivity >> s.lid_maximal_frag_dev
         >> s.lid_correction_ratio >> s.nw_gap_penalty>> s.nw_exclude_m0
         >> s.mid_distance_cutoff;
+    if(version >= 2) {
+        QVector<double> sweep;
+        qint32 bandWidth;
+        in >> sweep >> bandWidth >> s.nw_band_adaptive;
+        s.nw_gap_penalty_sweep = sweep.toStdVector();
+        s.nw_band_width = bandWidth;
+    }
     s.experiment = t.toStdString();
     s.cmp_id_library = lib.toStdString();
 
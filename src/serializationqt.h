@@ -36,6 +36,7 @@
 namespace mia {
 
 #define SERIALIZATIONQT_H_MD_VERSION 4
+#define SERIALIZATIONQT_H_SETTINGS_VERSION 2 /**< Settings format; version 1 lacks the version number and the alignment band and gap penalty sweep settings. */
 
 /** Serialization functions to use with QDataStreams */
 
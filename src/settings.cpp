@@ -60,6 +60,8 @@ Settings::Settings()
     lid_max_mass_isotopomer = 20;
 
     nw_gap_penalty = 0.2;
+    nw_band_width = 0;
+    nw_band_adaptive = false;
     nw_exclude_m0 = false;
     mid_distance_cutoff = 0.0;
     labels_max_hits = 2;
@@ -97,6 +99,9 @@ Settings::Settings(const Settings &s)
     lid_max_mass_isotopomer = s.lid_max_mass_isotopomer;
     lid_min_m0 = s.lid_min_m0;
     nw_gap_penalty = s.nw_gap_penalty;
+    nw_gap_penalty_sweep = s.nw_gap_penalty_sweep;
+    nw_band_width = s.nw_band_width;
+    nw_band_adaptive = s.nw_band_adaptive;
     nw_exclude_m0 = s.nw_exclude_m0;
     mid_distance_cutoff = s.mid_distance_cutoff;
 }
@@ -143,6 +148,9 @@ bool Settings::settingsChanged(const Settings &other, Settings::SettingsGroup wh
     }
     if(which & NWSettings) {
         unchanged = (nw_gap_penalty == other.nw_gap_penalty)
+                && (nw_gap_penalty_sweep == other.nw_gap_penalty_sweep)
+                && (nw_band_width == other.nw_band_width)
+                && (nw_band_adaptive == other.nw_band_adaptive)
                 && (nw_exclude_m0 == other.nw_exclude_m0)
                 && (mid_distance_cutoff == other.mid_distance_cutoff);
     }
@@ -188,6 +196,10 @@ std::string Settings::toString() const
     ss << "lid_min_m0 = " << lid_min_m0 << std::endl;
     ss << "lid_max_mass_isotopomer = " << lid_max_mass_isotopomer << std::endl;
     ss << "nw_gap_penalty = " << nw_gap_penalty << std::endl;
+    for(std::vector<double>::const_iterator it = nw_gap_penalty_sweep.begin(); it != nw_gap_penalty_sweep.end(); ++it)
+        ss << "nw_gap_penalty_sweep = " << *it << std::endl;
+    ss << "nw_band_width = " << nw_band_width << std::endl;
+    ss << "nw_band_adaptive = " << nw_band_adaptive << std::endl;
     ss << "nw_exclude_m0 = " << nw_exclude_m0 << std::endl;
     ss << "mid_distance_cutoff = " << mid_distance_cutoff << std::endl;
     return ss.str();
@@ -224,6 +236,14 @@ std::string Settings::toXML() const
     ss << "<lid_min_m0 value=\"" << lid_min_m0 << "\"/>" << std::endl;
     ss << "<lid_max_mass_isotopomer value=\"" << lid_max_mass_isotopomer << "\"/>" << std::endl;
     ss << "<nw_gap_penalty value=\"" << nw_gap_penalty << "\"/>" << std::endl;
+    if(nw_gap_penalty_sweep.size()) {
+        ss << "<nw_gap_penalty_sweep value=\"";
+        for(std::vector<double>::const_iterator it = nw_gap_penalty_sweep.begin(); it != nw_gap_penalty_sweep.end(); ++it)
+            ss << (it == nw_gap_penalty_sweep.begin() ? "" : ",") << *it;
+        ss << "\"/>" << std::endl;
+    }
+    ss << "<nw_band_width value=\"" << nw_band_width << "\"/>" << std::endl;
+    ss << "<nw_band_adaptive value=\"" << nw_band_adaptive << "\"/>" << std::endl;
     ss << "<nw_exclude_m0 value=\"" << nw_exclude_m0 << "\"/>" << std::endl;
     ss << "<mid_distance_cutoff value=\"" << mid_distance_cutoff << "\"/>" << std::endl;
 
@@ -89,6 +89,9 @@ public:
 
     // Network construction settings
     double nw_gap_penalty;              /**< Gap penalty for needleman wunsch scoring. */
+    std::vector<double> nw_gap_penalty_sweep; /**< Additional gap penalties to create distance matrices for, see LabelingNetworkSet::createDistanceMatrixSweep. */
+    int nw_band_width;                  /**< Restrict alignment of MIDs longer than MIDDistanceCalculator::maxFixedLength to a diagonal band of this width, 0 for full alignment. See MIDDistanceCalculator::getBand. */
+    bool nw_band_adaptive;              /**< Widen the alignment band by the MID length difference? */
     bool nw_exclude_m0;                 /**< Exclude M+0 abundance for distance calculation & scoring? */
     double mid_distance_cutoff;         /**< Distance threshold for network edges (lower/upper?). */
 };
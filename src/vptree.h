@@ -0,0 +1,191 @@
+/* * MIA - Mass Isotopolome Analyzer
+ * Copyright (C) 2013-15 Daniel Weindl <daniel@danielweindl.de>
+ *
+ * This file is part of MIA.
+ *
+ * MIA is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * MIA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with MIA.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VPTREE_H
+#define VPTREE_H
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <limits>
+
+namespace mia {
+
+/**
+ * @brief The VPTree class is a vantage-point tree for k-nearest-neighbor queries over items identified by integers.
+ *
+ * Each node splits its items by the median distance to its vantage point, so a query only needs distances to a fraction
+ * of all items. Subtrees are pruned by the triangle inequality: results are exact if the distance is a metric and
+ * approximate otherwise.
+ *
+ * @tparam Distance Functor with double operator()(int item1, int item2) const. Queries may run concurrently, so it must be thread-safe.
+ */
+template<typename Distance>
+class VPTree
+{
+public:
+    typedef std::pair<double, int> Neighbor; /**< Distance and item */
+
+    VPTree(const std::vector<int> &items, const Distance &distance);
+
+    int getNearestNeighbors(int item, int k, std::vector<Neighbor> &neighbors) const;
+    int getBuildDistanceCount() const { return buildDistanceCount; }
+
+private:
+    struct Node {
+        int item;       /**< Vantage point */
+        double radius;  /**< Median distance of the other items of the subtree to the vantage point */
+        int inside;     /**< Subtree of items not farther than radius, -1 if empty */
+        int outside;    /**< Subtree of items not closer than radius, -1 if empty */
+    };
+
+    int build(std::vector<int>::iterator begin, std::vector<int>::iterator end, std::vector<Neighbor> &scratch);
+    void search(int node, int item, int k, std::priority_queue<Neighbor> &heap, double &tau, int &count) const;
+
+    Distance distance;
+    std::vector<Node> nodes;
+    int root;
+    int buildDistanceCount;
+    unsigned int seed; /**< For choosing vantage points, fixed so trees are reproducible */
+};
+
+/**
+ * @brief Build the tree.
+ * @param items Items to index
+ * @param distance Distance between items
+ */
+template<typename Distance>
+VPTree<Distance>::VPTree(const std::vector<int> &items, const Distance &distance)
+    : distance(distance), root(-1), buildDistanceCount(0), seed(1)
+{
+    std::vector<int> order(items);
+    std::vector<Neighbor> scratch;
+    nodes.reserve(items.size());
+    root = build(order.begin(), order.end(), scratch);
+}
+
+template<typename Distance>
+int VPTree<Distance>::build(std::vector<int>::iterator begin, std::vector<int>::iterator end, std::vector<Neighbor> &scratch)
+{
+    if(begin == end)
+        return -1;
+
+    // random vantage point, keeps the tree balanced for sorted input
+    seed = seed * 1103515245 + 12345;
+    std::iter_swap(begin, begin + (seed >> 8) % (end - begin));
+
+    int index = nodes.size();
+    Node node;
+    node.item = *begin;
+    node.radius = 0;
+    node.inside = -1;
+    node.outside = -1;
+    nodes.push_back(node);
+
+    if(end - begin == 1)
+        return index;
+
+    scratch.clear();
+    for(std::vector<int>::iterator it = begin + 1; it != end; ++it)
+        scratch.push_back(Neighbor(distance(node.item, *it), *it));
+    buildDistanceCount += scratch.size();
+
+    // split at the median
+    std::vector<Neighbor>::iterator median = scratch.begin() + scratch.size() / 2;
+    std::nth_element(scratch.begin(), median, scratch.end());
+    double radius = median->first;
+    for(size_t i = 0; i < scratch.size(); ++i)
+        begin[i + 1] = scratch[i].second;
+
+    std::vector<int>::iterator split = begin + 1 + (median - scratch.begin());
+    int inside = build(begin + 1, split, scratch);
+    int outside = build(split, end, scratch);
+
+    nodes[index].radius = radius;
+    nodes[index].inside = inside;
+    nodes[index].outside = outside;
+
+    return index;
+}
+
+/**
+ * @brief Find the @p k items closest to @p item, which itself is not included.
+ * @param item Query item; does not need to be part of the tree
+ * @param k Number of neighbors
+ * @param neighbors Output, by increasing distance; items with the same distance by increasing item
+ * @return Number of distances calculated
+ */
+template<typename Distance>
+int VPTree<Distance>::getNearestNeighbors(int item, int k, std::vector<Neighbor> &neighbors) const
+{
+    std::priority_queue<Neighbor> heap; // current k best, farthest on top
+    double tau = std::numeric_limits<double>::infinity();
+    int count = 0;
+    if(k > 0)
+        search(root, item, k, heap, tau, count);
+
+    neighbors.resize(heap.size());
+    for(int i = neighbors.size() - 1; i >= 0; --i) {
+        neighbors[i] = heap.top();
+        heap.pop();
+    }
+
+    return count;
+}
+
+template<typename Distance>
+void VPTree<Distance>::search(int node, int item, int k, std::priority_queue<Neighbor> &heap, double &tau, int &count) const
+{
+    if(node < 0)
+        return;
+
+    const Node &n = nodes[node];
+    double d = 0;
+    if(n.item != item) {
+        d = distance(item, n.item);
+        ++count;
+        Neighbor neighbor(d, n.item);
+        if((int)heap.size() < k) {
+            heap.push(neighbor);
+        } else if(neighbor < heap.top()) {
+            heap.pop();
+            heap.push(neighbor);
+        }
+        if((int)heap.size() == k)
+            tau = heap.top().first;
+    }
+
+    // closer side first, it tightens tau. Negated comparisons, so subtrees are not pruned if
+    // infinite distances give NaN.
+    if(d <= n.radius) {
+        if(!(d - tau > n.radius))
+            search(n.inside, item, k, heap, tau, count);
+        if(!(d + tau < n.radius))
+            search(n.outside, item, k, heap, tau, count);
+    } else {
+        if(!(d + tau < n.radius))
+            search(n.outside, item, k, heap, tau, count);
+        if(!(d - tau > n.radius))
+            search(n.inside, item, k, heap, tau, count);
+    }
+}
+
+}
+
+#endif // VPTREE_H